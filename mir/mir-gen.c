@@ -2098,6 +2098,7 @@ static void copy_prop (gen_ctx_t gen_ctx) {
           se->use = bb_insn;
           se->use_op_num = op_num;
           rename_op_reg (gen_ctx, &insn->ops[op_num], reg, new_reg, insn);
+          var = reg2var (gen_ctx, new_reg); /* the operand now refers to the copy source */
         }
       }
       w = get_ext_params (insn->code, &sign_p);
@@ -6,6 +6,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk *chunk) {
@@ -44,4 +45,102 @@ void freeChunk(Chunk* chunk) {
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
-}
\ No newline at end of file
+}
+
+uint8_t baseOpcode(uint8_t instruction) {
+    switch (instruction) {
+    case OP_GET_LOCAL2:
+    case OP_ADD_LOCAL_CONST:
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return OP_GET_LOCAL;
+    case OP_ARITH_CONST:
+        return OP_CONSTANT;
+    case OP_SET_LOCAL_POP:
+        return OP_SET_LOCAL;
+    case OP_SET_GLOBAL_POP:
+        return OP_SET_GLOBAL;
+    case OP_ADD_NUMBER:
+        return OP_ADD;
+    case OP_GET_FIELD:
+        return OP_GET_PROPERTY;
+    case OP_SET_FIELD:
+        return OP_SET_PROPERTY;
+    default:
+        return instruction;
+    }
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+    switch (baseOpcode(chunk->code[offset])) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+        return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 4;
+    case OP_INVOKE:
+        return 5;
+    case OP_CLOSURE: {
+        ObjFunction *function =
+            AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    default:
+        return 1;
+    }
+}
+
+int stackEffect(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code;
+    switch (baseOpcode(code[offset])) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+        return -1;
+    case OP_CALL:
+        return -code[offset + 1];
+    case OP_INVOKE:
+        return -code[offset + 2];
+    case OP_SUPER_INVOKE:
+        return -code[offset + 2] - 1;
+    default:
+        return 0;
+    }
+}
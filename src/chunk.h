@@ -13,13 +13,13 @@ typedef enum {
     OP_POP,             // 弹出指令
     OP_GET_LOCAL,       // 获取局部变量
     OP_SET_LOCAL,       // 赋值局部变量
-    OP_GET_GLOBAL,      // 获取全局变量
-    OP_DEFINE_GLOBAL,   // 定义全局变量
-    OP_SET_GLOBAL,      // 赋值全局变量
+    OP_GET_GLOBAL,      // 获取全局变量 操作数为两字节的全局变量下标
+    OP_DEFINE_GLOBAL,   // 定义全局变量 操作数同上
+    OP_SET_GLOBAL,      // 赋值全局变量 操作数同上
     OP_GET_UPVALUE,     // 获取升值指令
     OP_SET_UPVALUE,     // 赋值升值指令
-    OP_GET_PROPERTY,    // 获取属性指令
-    OP_SET_PROPERTY,    // 赋值属性指令
+    OP_GET_PROPERTY,    // 获取属性指令 操作数为属性名和内联缓存编号
+    OP_SET_PROPERTY,    // 赋值属性指令 操作数为属性名和内联缓存编号
     OP_GET_SUPER,       // 获取父类指令
     OP_EQUAL,           // 赋值指令 =
     OP_GREATER,         // 大于指令 >
@@ -35,14 +35,69 @@ typedef enum {
     OP_JUMP_IF_FALSE,   // if false分支跳转指令
     OP_LOOP,            // 循环指令
     OP_CALL,            // 调用指令
-    OP_INVOKE,          // 执行指令
+    OP_INVOKE,          // 执行指令 操作数为方法名、参数数和内联缓存编号
     OP_SUPER_INVOKE,    // 父类执行指令
     OP_CLOSURE,         // 闭包指令
     OP_CLOSE_UPVALUE,   // 关闭提升值
     OP_RETURN,          // 返回指令
     OP_CLASS,           // 类指令
     OP_INHERIT,         // 继承指令
-    OP_METHOD           // 方法指令
+    OP_METHOD,          // 方法指令
+
+    // 以下指令不由编译器直接生成 只改写指令序列首个指令的操作码
+    // 操作数和序列中其余指令的字节保持原样 跳转偏移和行号都不变
+    // 从序列中间恢复执行(JIT退优化)时按原指令执行即可
+    // 超级指令 编译结束时由optimizeChunk融合
+    OP_GET_LOCAL2,            // GET_LOCAL a; GET_LOCAL b
+    OP_SET_LOCAL_POP,         // SET_LOCAL a; POP
+    OP_SET_GLOBAL_POP,        // SET_GLOBAL a; POP
+    OP_ADD_LOCAL_CONST,       // GET_LOCAL a; CONSTANT k; ADD; SET_LOCAL b; POP
+    OP_LESS_LOCAL_CONST_JUMP, // GET_LOCAL a; CONSTANT k; LESS; JUMP_IF_FALSE; POP
+    OP_ARITH_CONST,           // CONSTANT k; ADD/SUBTRACT/MULTIPLY/DIVIDE
+    // 快速化指令 原指令首次执行后按观察到的类型改写 推测失败时改回
+    OP_ADD_NUMBER,            // 操作数都是数字的OP_ADD
+    OP_GET_FIELD,             // 缓存首项为字段的OP_GET_PROPERTY
+    OP_SET_FIELD,             // 缓存首项为已有字段的OP_SET_PROPERTY
+
+    // 寄存器字节码 选择寄存器目标时由register.c从栈字节码翻译 存在函数的registerCode里
+    // 寄存器就是栈帧中的槽 槽r的值与栈字节码中栈深度r处的值相同
+    // A为目标寄存器 B/C为源寄存器 K为常量下标 off为两字节跳转偏移
+    OP_REG_STACK,             // d: 栈顶设为槽d 接着执行后面的一条栈指令
+    OP_REG_MOVE,              // A B: r[A] = r[B]
+    OP_REG_LOADK,             // A K: r[A] = K
+    OP_REG_NIL,               // A
+    OP_REG_TRUE,              // A
+    OP_REG_FALSE,             // A
+    OP_REG_GET_GLOBAL,        // A slot(2)
+    OP_REG_DEFINE_GLOBAL,     // B slot(2)
+    OP_REG_SET_GLOBAL,        // B slot(2)
+    OP_REG_GET_UPVALUE,       // A index
+    OP_REG_SET_UPVALUE,       // B index
+    OP_REG_EQUAL,             // A B C
+    OP_REG_GREATER,           // A B C
+    OP_REG_LESS,              // A B C
+    OP_REG_ADD,               // A B C T: 拼接字符串时栈顶设为槽T
+    OP_REG_SUBTRACT,          // A B C
+    OP_REG_MULTIPLY,          // A B C
+    OP_REG_DIVIDE,            // A B C
+    OP_REG_GREATER_K,         // A B K: K为数字常量 下同
+    OP_REG_LESS_K,            // A B K
+    OP_REG_ADD_K,             // A B K
+    OP_REG_SUBTRACT_K,        // A B K
+    OP_REG_MULTIPLY_K,        // A B K
+    OP_REG_DIVIDE_K,          // A B K
+    OP_REG_NOT,               // A B
+    OP_REG_NEGATE,            // A B
+    OP_REG_PRINT,             // B
+    OP_REG_JUMP,              // off
+    OP_REG_JUMP_IF_FALSE,     // B off
+    OP_REG_JUMP_IF_NOT_LESS,     // B C off
+    OP_REG_JUMP_IF_NOT_LESS_K,   // B K off
+    OP_REG_JUMP_IF_NOT_GREATER,  // B C off
+    OP_REG_JUMP_IF_NOT_GREATER_K,// B K off
+    OP_REG_LOOP,              // off pc(2) d: pc为栈字节码中的OP_LOOP 循环头栈深度为d
+    OP_REG_CALL,              // A argCount: 被调用者在r[A] 参数依次在其后 结果写回r[A]
+    OP_REG_RETURN,            // B
 } OpCode;
 
 // 字节码块
@@ -57,6 +112,15 @@ typedef struct {
 // 初始化字节码块
 void initChunk(Chunk* chunk);
 
+// 超级指令和快速化指令对应的原指令 其余指令原样返回
+uint8_t baseOpcode(uint8_t instruction);
+
+// offset处指令的长度 超级指令按其首个指令计算
+int instructionLength(Chunk* chunk, int offset);
+
+// offset处的栈指令执行后栈深度的变化
+int stackEffect(Chunk* chunk, int offset);
+
 // 写入一个字节操作码到字节码块
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
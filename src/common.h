@@ -17,6 +17,12 @@
 // 打印虚拟机栈和反汇编说明
 // #define DEBUG_TRACE_EXECUTION
 
+// 把JIT生成的MIR模块或C代码写到当前目录的jit_func_N文件
+// #define DEBUG_DUMP_JIT
+
+// 解释器用switch分派 默认在GCC/Clang下用标签地址直接线程分派
+// #define SWITCH_DISPATCH
+
 // 频繁调用垃圾回收
 //#define DEBUG_STRESS_GC
 
@@ -29,4 +35,11 @@
 // 是否开启JIT功能
 // #define OPEN_JIT
 
+// 函数调用次数加回边次数达到该值后才交给JIT编译 可用--jit-threshold修改
+// 0表示首次调用即编译 负数表示只解释执行
+#define JIT_THRESHOLD 1000
+
+// JIT先生成C代码再用c2mir编译 仅用于调试对照 默认直接生成MIR
+// #define JIT_C_BACKEND
+
 #endif
\ No newline at end of file
@@ -11,6 +11,8 @@
 #include "scanner.h"
 #include "memory.h"
 #include "object.h"
+#include "register.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 
@@ -178,6 +180,22 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+// 为属性访问指令分配内联缓存 编号写成两字节操作数
+static void emitInlineCache() {
+    int index = current->function->inlineCacheCount;
+    if (index > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+    }
+    current->function->inlineCacheCount++;
+    emitBytes((index >> 8) & 0xff, index & 0xff);
+}
+
+// 写入全局变量指令 下标写成两字节操作数
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+    emitByte(instruction);
+    emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
 // 写入循环指令
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
@@ -210,6 +228,8 @@ static void emitReturn() {
 // 写入常量数组并返回索引
 static uint8_t makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
+    // 编译期间的分配可能让正在编译的函数晋升
+    writeBarrier((Obj *)current->function, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -252,6 +272,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj *)current->function, OBJ_VAL(current->function->name));
     }
 
     // 局部插槽将空字符串占用 无法显式使用
@@ -268,15 +289,110 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 }
 
 // 结束编译
+// 指令序列可以融合 序列中除首个指令外都不是跳转目标
+static bool canFuse(Chunk *chunk, bool *targets, int offset, int length) {
+    if (offset + length > chunk->count) return false;
+    for (int pc = offset + instructionLength(chunk, offset);
+         pc < offset + length; pc += instructionLength(chunk, pc)) {
+        if (targets[pc]) return false;
+    }
+    return true;
+}
+
+// 序列中offset + index处是指定的指令
+#define CODE_AT(index, op) (code[offset + (index)] == (op))
+
+// 窥孔优化 把常见的指令序列融合成超级指令
+// 只改写首个指令的操作码 见chunk.h
+static void optimizeChunk(Chunk *chunk) {
+    uint8_t *code = chunk->code;
+    bool *targets = calloc(chunk->count + 1, sizeof(bool));
+    if (targets == NULL) exit(1);
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        if (code[pc] == OP_JUMP || code[pc] == OP_JUMP_IF_FALSE) {
+            targets[pc + 3 + ((code[pc + 1] << 8) | code[pc + 2])] = true;
+        } else if (code[pc] == OP_LOOP) {
+            targets[pc + 3 - ((code[pc + 1] << 8) | code[pc + 2])] = true;
+        }
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (CODE_AT(0, OP_GET_LOCAL)) {
+            // 常量是数字时 a + k只可能是数字相加
+            bool numberConstant =
+                canFuse(chunk, targets, offset, 4) && CODE_AT(2, OP_CONSTANT) &&
+                IS_NUMBER(chunk->constants.values[code[offset + 3]]);
+            if (numberConstant && canFuse(chunk, targets, offset, 8) &&
+                CODE_AT(4, OP_ADD) && CODE_AT(5, OP_SET_LOCAL) &&
+                CODE_AT(7, OP_POP)) {
+                code[offset] = OP_ADD_LOCAL_CONST;
+            } else if (numberConstant && canFuse(chunk, targets, offset, 9) &&
+                       CODE_AT(4, OP_LESS) && CODE_AT(5, OP_JUMP_IF_FALSE) &&
+                       CODE_AT(8, OP_POP) &&
+                       code[offset + 8 + ((code[offset + 6] << 8) |
+                                          code[offset + 7])] == OP_POP) {
+                // 条件为假时直接跳过目标处弹出条件的OP_POP
+                code[offset] = OP_LESS_LOCAL_CONST_JUMP;
+            } else if (canFuse(chunk, targets, offset, 4) &&
+                       CODE_AT(2, OP_GET_LOCAL)) {
+                code[offset] = OP_GET_LOCAL2;
+            }
+        } else if (CODE_AT(0, OP_CONSTANT) &&
+                   canFuse(chunk, targets, offset, 3) &&
+                   IS_NUMBER(chunk->constants.values[code[offset + 1]]) &&
+                   (CODE_AT(2, OP_ADD) || CODE_AT(2, OP_SUBTRACT) ||
+                    CODE_AT(2, OP_MULTIPLY) || CODE_AT(2, OP_DIVIDE))) {
+            code[offset] = OP_ARITH_CONST;
+        } else if (CODE_AT(0, OP_SET_LOCAL) &&
+                   canFuse(chunk, targets, offset, 3) && CODE_AT(2, OP_POP)) {
+            code[offset] = OP_SET_LOCAL_POP;
+        } else if (CODE_AT(0, OP_SET_GLOBAL) &&
+                   canFuse(chunk, targets, offset, 4) && CODE_AT(3, OP_POP)) {
+            code[offset] = OP_SET_GLOBAL_POP;
+        }
+    }
+    free(targets);
+}
+
+#undef CODE_AT
+
+void finishFunction(ObjFunction *function, bool optimize) {
+    if (optimize) {
+        // 寄存器字节码从融合前的栈字节码翻译
+        if (vm.registerTarget) {
+            compileRegisterCode(function);
+        }
+        optimizeChunk(&function->chunk);
+    }
+    // 没有属性访问和方法调用的函数不需要内联缓存 inlineCaches保持NULL
+    if (function->inlineCacheCount > 0) {
+        function->inlineCaches =
+            ALLOCATE(InlineCache, function->inlineCacheCount);
+        memset(function->inlineCaches, 0,
+               sizeof(InlineCache) * function->inlineCacheCount);
+    }
+#ifdef OPEN_JIT
+    // 字节码不再变化 按长度分配类型记录
+    function->typeProfile = ALLOCATE(uint8_t, function->chunk.count);
+    memset(function->typeProfile, 0, function->chunk.count);
+#endif
+}
+
 static ObjFunction* endCompiler() {
 
     emitReturn();
     ObjFunction* function = current->function;
+    finishFunction(function, !parser.hadError);
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars : "<script>");
+        if (function->registerCode.count > 0) {
+            disassembleRegisterCode(function, function->name != NULL
+                                              ? function->name->chars : "<script>");
+        }
     }
 #endif
     // 编译结束还原 上个编译器
@@ -321,6 +437,16 @@ static uint8_t identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// 全局变量下标 编译期分配 运行时按下标存取不再查表
+static uint16_t identifierSlot(Token *name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
+
 // 变量名比较
 static bool identifiersEqual(Token *a, Token *b) {
     if (a->length != b->length) return false;
@@ -412,14 +538,14 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-// 解析变量
-static uint8_t parseVariable(const char *errorMessage) {
+// 解析变量 全局变量返回下标
+static uint16_t parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierSlot(&parser.previous);
 }
 
 // 标记局部变量为已初始化
@@ -430,12 +556,12 @@ static void markInitialized() {
 }
 
 // 定义全局变量
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 // 参数列表
@@ -520,12 +646,15 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitInlineCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache();
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        emitInlineCache();
     }
 }
 
@@ -587,17 +716,21 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierSlot(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
     // 接等号为赋值  反之为取值
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t) arg);
+        op = setOp;
+    }
+    if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(op, (uint16_t) arg);
     } else {
-        emitBytes(getOp, (uint8_t) arg);
+        emitBytes(op, (uint8_t) arg);
     }
 }
 
@@ -769,7 +902,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -801,7 +934,7 @@ static void method() {
 
 // 函数声明
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -813,9 +946,10 @@ static void classDeclaration() {
     Token className = parser.previous;
     uint8_t nameConstant = identifierConstant(&parser.previous);
     declareVariable();
+    uint16_t global = current->scopeDepth > 0 ? 0 : identifierSlot(&className);
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -857,7 +991,7 @@ static void classDeclaration() {
 
 // 变量声明
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
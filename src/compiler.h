@@ -10,6 +10,10 @@
 // 编译
 ObjFunction* compile(const char* source);
 
+// 字节码写完后的处理 编译结束和读入快照时调用
+// optimize为true时生成寄存器字节码并融合超级指令 之后分配内联缓存和类型记录
+void finishFunction(ObjFunction *function, bool optimize);
+
 // 标记编译根对象
 void markCompilerRoots();
 
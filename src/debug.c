@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name); // 打印字节码块名
@@ -47,6 +48,16 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;  // 操作码 + 操作数 偏移量为2
 }
 
+// 全局变量指令 两字节下标 + 变量名
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 // 解释执行字节码块
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -57,6 +68,29 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 3;
 }
 
+// 带内联缓存的属性指令
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [ic %d]\n", cache);
+    return offset + 4;
+}
+
+// 带内联缓存的方法调用指令
+static int cachedInvokeInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [ic %d]\n", cache);
+    return offset + 5;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);    // 字节码偏移量
     // 行号打印
@@ -84,19 +118,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -128,7 +162,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -158,8 +192,183 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        // 超级指令只打印首个指令的操作数 融合的其余指令照常逐条打印
+        case OP_GET_LOCAL2:
+            return byteInstruction("OP_GET_LOCAL2", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ARITH_CONST:
+            return constantInstruction("OP_ARITH_CONST", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return byteInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return byteInstruction("OP_LESS_LOCAL_CONST_JUMP", chunk, offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_GET_FIELD:
+            return propertyInstruction("OP_GET_FIELD", chunk, offset);
+        case OP_SET_FIELD:
+            return propertyInstruction("OP_SET_FIELD", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+
+void disassembleRegisterCode(ObjFunction *function, const char *name) {
+    printf("== %s (registers) ==\n", name);
+
+    for (int offset = 0; offset < function->registerCode.count;) {
+        offset = disassembleRegisterInstruction(function, offset);
+    }
+}
+
+// 寄存器指令 format中每个字符对应一个操作数
+// r寄存器 k常量 n一字节整数 g全局变量下标 j向前跳转 l向后跳转 p栈字节码偏移
+static int registerInstruction(const char *name, const char *format,
+                               ObjFunction *function, int offset) {
+    uint8_t *code = function->registerCode.code;
+    int end = offset + 1;
+    for (const char *c = format; *c != '\0'; c++) {
+        end += (*c == 'g' || *c == 'j' || *c == 'l' || *c == 'p') ? 2 : 1;
+    }
+
+    printf("%-16s", name);
+    int at = offset + 1;
+    for (const char *c = format; *c != '\0'; c++) {
+        uint16_t operand = code[at];
+        if (*c == 'g' || *c == 'j' || *c == 'l' || *c == 'p') {
+            operand = (uint16_t) ((code[at] << 8) | code[at + 1]);
+            at += 2;
+        } else {
+            at++;
+        }
+        switch (*c) {
+            case 'r':
+                printf(" r%d", operand);
+                break;
+            case 'k':
+                printf(" '");
+                printValue(function->chunk.constants.values[operand]);
+                printf("'");
+                break;
+            case 'g':
+                printf(" '");
+                printValue(vm.globalNames.values[operand]);
+                printf("'");
+                break;
+            case 'j':
+                printf(" -> %d", end + operand);
+                break;
+            case 'l':
+                printf(" -> %d", end - operand);
+                break;
+            case 'p':
+                printf(" [%d]", operand);
+                break;
+            default:
+                printf(" %d", operand);
+                break;
+        }
+    }
+    printf("\n");
+    return end;
+}
+
+int disassembleRegisterInstruction(ObjFunction *function, int offset) {
+    uint8_t instruction = function->registerCode.code[offset];
+    // 嵌入的栈指令 常量在栈字节码块里
+    if (instruction < OP_REG_STACK) {
+        Chunk chunk = function->registerCode;
+        chunk.constants = function->chunk.constants;
+        return disassembleInstruction(&chunk, offset);
+    }
+
+    Chunk *chunk = &function->registerCode;
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    switch (instruction) {
+        case OP_REG_STACK:
+            return registerInstruction("OP_REG_STACK", "n", function, offset);
+        case OP_REG_MOVE:
+            return registerInstruction("OP_REG_MOVE", "rr", function, offset);
+        case OP_REG_LOADK:
+            return registerInstruction("OP_REG_LOADK", "rk", function, offset);
+        case OP_REG_NIL:
+            return registerInstruction("OP_REG_NIL", "r", function, offset);
+        case OP_REG_TRUE:
+            return registerInstruction("OP_REG_TRUE", "r", function, offset);
+        case OP_REG_FALSE:
+            return registerInstruction("OP_REG_FALSE", "r", function, offset);
+        case OP_REG_GET_GLOBAL:
+            return registerInstruction("OP_REG_GET_GLOBAL", "rg", function, offset);
+        case OP_REG_DEFINE_GLOBAL:
+            return registerInstruction("OP_REG_DEFINE_GLOBAL", "rg", function, offset);
+        case OP_REG_SET_GLOBAL:
+            return registerInstruction("OP_REG_SET_GLOBAL", "rg", function, offset);
+        case OP_REG_GET_UPVALUE:
+            return registerInstruction("OP_REG_GET_UPVALUE", "rn", function, offset);
+        case OP_REG_SET_UPVALUE:
+            return registerInstruction("OP_REG_SET_UPVALUE", "rn", function, offset);
+        case OP_REG_EQUAL:
+            return registerInstruction("OP_REG_EQUAL", "rrr", function, offset);
+        case OP_REG_GREATER:
+            return registerInstruction("OP_REG_GREATER", "rrr", function, offset);
+        case OP_REG_LESS:
+            return registerInstruction("OP_REG_LESS", "rrr", function, offset);
+        case OP_REG_ADD:
+            return registerInstruction("OP_REG_ADD", "rrrr", function, offset);
+        case OP_REG_SUBTRACT:
+            return registerInstruction("OP_REG_SUBTRACT", "rrr", function, offset);
+        case OP_REG_MULTIPLY:
+            return registerInstruction("OP_REG_MULTIPLY", "rrr", function, offset);
+        case OP_REG_DIVIDE:
+            return registerInstruction("OP_REG_DIVIDE", "rrr", function, offset);
+        case OP_REG_GREATER_K:
+            return registerInstruction("OP_REG_GREATER_K", "rrk", function, offset);
+        case OP_REG_LESS_K:
+            return registerInstruction("OP_REG_LESS_K", "rrk", function, offset);
+        case OP_REG_ADD_K:
+            return registerInstruction("OP_REG_ADD_K", "rrk", function, offset);
+        case OP_REG_SUBTRACT_K:
+            return registerInstruction("OP_REG_SUBTRACT_K", "rrk", function, offset);
+        case OP_REG_MULTIPLY_K:
+            return registerInstruction("OP_REG_MULTIPLY_K", "rrk", function, offset);
+        case OP_REG_DIVIDE_K:
+            return registerInstruction("OP_REG_DIVIDE_K", "rrk", function, offset);
+        case OP_REG_NOT:
+            return registerInstruction("OP_REG_NOT", "rr", function, offset);
+        case OP_REG_NEGATE:
+            return registerInstruction("OP_REG_NEGATE", "rr", function, offset);
+        case OP_REG_PRINT:
+            return registerInstruction("OP_REG_PRINT", "r", function, offset);
+        case OP_REG_JUMP:
+            return registerInstruction("OP_REG_JUMP", "j", function, offset);
+        case OP_REG_JUMP_IF_FALSE:
+            return registerInstruction("OP_REG_JUMP_IF_FALSE", "rj", function, offset);
+        case OP_REG_JUMP_IF_NOT_LESS:
+            return registerInstruction("OP_REG_JUMP_IF_NOT_LESS", "rrj", function, offset);
+        case OP_REG_JUMP_IF_NOT_LESS_K:
+            return registerInstruction("OP_REG_JUMP_IF_NOT_LESS_K", "rkj", function, offset);
+        case OP_REG_JUMP_IF_NOT_GREATER:
+            return registerInstruction("OP_REG_JUMP_IF_NOT_GREATER", "rrj", function, offset);
+        case OP_REG_JUMP_IF_NOT_GREATER_K:
+            return registerInstruction("OP_REG_JUMP_IF_NOT_GREATER_K", "rkj", function, offset);
+        case OP_REG_LOOP:
+            return registerInstruction("OP_REG_LOOP", "lpn", function, offset);
+        case OP_REG_CALL:
+            return registerInstruction("OP_REG_CALL", "rn", function, offset);
+        case OP_REG_RETURN:
+            return registerInstruction("OP_REG_RETURN", "r", function, offset);
+        default:
+            printf("Unknown opcode %d\n", instruction);
+            return offset + 1;
+    }
+}
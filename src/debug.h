@@ -6,6 +6,7 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 // 反汇编字节码块
 void disassembleChunk(Chunk* chunk, const char* name);
@@ -13,5 +14,11 @@ void disassembleChunk(Chunk* chunk, const char* name);
 // 反汇编说明
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// 反汇编函数的寄存器字节码
+void disassembleRegisterCode(ObjFunction* function, const char* name);
+
+// 反汇编一条寄存器指令 嵌入的栈指令按栈指令打印
+int disassembleRegisterInstruction(ObjFunction* function, int offset);
+
 
 #endif
\ No newline at end of file
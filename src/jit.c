@@ -1,53 +1,1743 @@
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
 
 #include "jit.h"
 #include "memory.h"
 #include "mir-gen.h"
 
+#ifndef NAN_BOXING
+#error "JIT requires NAN_BOXING"
+#endif
+
+// JIT代码中的运行时错误
+typedef enum {
+    JIT_ERROR_NUMBERS,   // 二元运算操作数不是数字
+    JIT_ERROR_NUMBER,    // 一元运算操作数不是数字
+    JIT_ERROR_UNDEFINED, // 未定义的全局变量
+} JitError;
+
+static const char *jitErrorMessages[] = {
+    [JIT_ERROR_NUMBERS] = "Operands must be numbers.",
+    [JIT_ERROR_NUMBER] = "Operand must be a number.",
+    [JIT_ERROR_UNDEFINED] = "Undefined variable '%s'.",
+};
+
+// JIT代码报告运行时错误 消息用编号传递 生成的代码里不嵌入宿主指针
+static void jitRuntimeError(int error, ObjString *name) {
+    runtimeError(jitErrorMessages[error], name != NULL ? name->chars : "");
+}
+
+// 打印指令
+static void jitPrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+// 获取父类方法
+static bool jitGetSuper(ObjString *name) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+// 调用值 被调用者还没编译时由解释器执行完再返回
+static bool jitCallValue(Value callee, int argCount) {
+    int frameCount = vm.frameCount;
+    return callValue(callee, argCount) && finishCall(frameCount);
+}
+
+// 执行方法
+static bool jitInvoke(ObjString *name, int argCount, InlineCache *cache) {
+    int frameCount = vm.frameCount;
+    return invoke(name, argCount, cache) && finishCall(frameCount);
+}
+
+// 执行父类方法
+static bool jitSuperInvoke(ObjString *name, int argCount) {
+    int frameCount = vm.frameCount;
+    ObjClass *superclass = AS_CLASS(pop());
+    return invokeFromClass(superclass, name, argCount) &&
+           finishCall(frameCount);
+}
+
+// 非数字的加法 只剩字符串连接
+static bool jitAdd() {
+    if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+        concatenate();
+        return true;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+}
+
+// 继承
+static bool jitInherit() {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass *subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    rememberObject((Obj *)subclass);
+    pop(); // Subclass.
+    return true;
+}
+
+// 创建闭包 upvalues指向OP_CLOSURE后面的提升值操作数
+static void jitClosure(CallFrame *frame, ObjFunction *function,
+                       uint8_t *upvalues) {
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = upvalues[i * 2];
+        uint8_t index = upvalues[i * 2 + 1];
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
+    }
+}
+
+// 推测失败 丢弃函数的机器码 解释器补全类型记录后再重新编译
+static void jitDeoptimize(ObjFunction *function) {
+    function->jitFunction = NULL;
+    function->osrFunction = NULL;
+    function->callCount = 0;
+    function->loopCount = 0;
+}
+
+// JIT代码可以调用的运行时函数 顺序与LoxFunctions一致
+typedef enum {
+    HELPER_JIT_RUNTIME_ERROR,
+    HELPER_PRINT,
+    HELPER_GET_PROPERTY,
+    HELPER_SET_PROPERTY,
+    HELPER_GET_SUPER,
+    HELPER_ADD,
+    HELPER_CALL_VALUE,
+    HELPER_INVOKE,
+    HELPER_SUPER_INVOKE,
+    HELPER_CLOSURE,
+    HELPER_CLOSE_UPVALUES,
+    HELPER_NEW_CLASS,
+    HELPER_INHERIT,
+    HELPER_DEFINE_METHOD,
+    HELPER_DEOPTIMIZE,
+    HELPER_REMEMBER_OBJECT,
+    HELPER_VALUES_EQUAL,
+    HELPER_COUNT
+} HelperId;
+
+// 运行时函数 名字 地址 以及MIR调用签名
 typedef struct LoxFunction {
     const char *name;
     void *func;
+    MIR_type_t result;   // 返回值类型 MIR_T_UNDEF表示没有返回值
+    int argCount;        // 参数个数
+    MIR_type_t args[3];  // 参数类型
 } LoxFunction;
 
-static const char LOX_HEADER[];
+static LoxFunction LoxFunctions[HELPER_COUNT] = {
+    {"jitRuntimeError", jitRuntimeError, MIR_T_UNDEF, 2, {MIR_T_I32, MIR_T_P}},
+    {"jitPrint", jitPrint, MIR_T_UNDEF, 1, {MIR_T_I64}},
+    {"getProperty", getProperty, MIR_T_U8, 2, {MIR_T_P, MIR_T_P}},
+    {"setProperty", setProperty, MIR_T_U8, 2, {MIR_T_P, MIR_T_P}},
+    {"jitGetSuper", jitGetSuper, MIR_T_U8, 1, {MIR_T_P}},
+    {"jitAdd", jitAdd, MIR_T_U8, 0, {MIR_T_UNDEF}},
+    {"jitCallValue", jitCallValue, MIR_T_U8, 2, {MIR_T_I64, MIR_T_I32}},
+    {"jitInvoke", jitInvoke, MIR_T_U8, 3, {MIR_T_P, MIR_T_I32, MIR_T_P}},
+    {"jitSuperInvoke", jitSuperInvoke, MIR_T_U8, 2, {MIR_T_P, MIR_T_I32}},
+    {"jitClosure", jitClosure, MIR_T_UNDEF, 3, {MIR_T_P, MIR_T_P, MIR_T_P}},
+    {"closeUpvalues", closeUpvalues, MIR_T_UNDEF, 1, {MIR_T_P}},
+    {"newClass", newClass, MIR_T_P, 1, {MIR_T_P}},
+    {"jitInherit", jitInherit, MIR_T_U8, 0, {MIR_T_UNDEF}},
+    {"defineMethod", defineMethod, MIR_T_UNDEF, 1, {MIR_T_P}},
+    {"jitDeoptimize", jitDeoptimize, MIR_T_UNDEF, 1, {MIR_T_P}},
+    {"rememberObject", rememberObject, MIR_T_UNDEF, 1, {MIR_T_P}},
+    {"valuesEqual", valuesEqual, MIR_T_U8, 2, {MIR_T_I64, MIR_T_I64}},
+};
+
+#ifdef JIT_C_BACKEND
+// C后端生成的代码还直接调用的运行时函数 原型写在生成的C代码里 这里只按名字导入
+typedef struct {
+    const char *name;
+    void *func;
+} CImport;
+
+static CImport CImports[] = {
+    {"runtimeError", runtimeError},
+    {"push", push},
+    {"pop", pop},
+    {"peek", peek},
+    {"tableGet", tableGet},
+    {"tableDelete", tableDelete},
+    {"tableAddAll", tableAddAll},
+    {"newClosure", newClosure},
+    {"captureUpvalue", captureUpvalue},
+    {"bindMethod", bindMethod},
+    {"printf", printf},
+    {"printValue", printValue},
+    {"isFalsey", isFalsey},
+    {"concatenate", concatenate},
+    {"numToValue", numToValue},
+    {"valueToNum", valueToNum},
+    {"isObjType", isObjType},
+};
+#endif
+
+static void *import_resolver(const char *name) {
+    for (int i = 0; i < HELPER_COUNT; i++) {
+        if (!strcmp(name, LoxFunctions[i].name)) {
+            return LoxFunctions[i].func;
+        }
+    }
+#ifdef JIT_C_BACKEND
+    for (size_t i = 0; i < sizeof(CImports) / sizeof(CImports[0]); i++) {
+        if (!strcmp(name, CImports[i].name)) {
+            return CImports[i].func;
+        }
+    }
+#endif
+    return NULL;
+}
+
+// 字节码副本 超级指令和快速化指令还原为原指令
+// 解释器只改写操作码 其余字节不变 逐条还原即可
+// 解释器会原地改写字节码 只能在解释器线程复制
+static uint8_t *baseCode(Chunk *chunk) {
+    uint8_t *code = malloc(chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        code[pc] = baseOpcode(code[pc]);
+    }
+    return code;
+}
+
+// 栈槽中值的表示
+typedef enum {
+    SLOT_VALUE,  // 装箱的值 在整数寄存器中
+    SLOT_NUMBER, // 确定是数字 拆箱后在双精度寄存器中
+} SlotKind;
+
+// MIR直接生成后端的编译状态
+typedef struct {
+    MIR_context_t ctx;
+    MIR_item_t func;                // 正在生成的MIR函数
+    MIR_item_t protos[HELPER_COUNT];
+    MIR_item_t imports[HELPER_COUNT];
+    ObjFunction *function;          // 被编译的Lox函数
+    Chunk chunk;                    // 字节码块副本 code为还原后的原指令
+    uint8_t *typeProfile;           // 类型记录的副本
+    MIR_label_t *labels;            // 跳转目标偏移对应的标签
+    int *depths;                    // 每条指令执行前的栈深度 -1为不可达
+    uint8_t *entryKinds;            // 每条指令执行前各栈槽的SlotKind
+    bool *captured;                 // 被闭包捕获过的栈槽
+    bool *written;                  // 被OP_SET_LOCAL改写过的栈槽
+    MIR_label_t errorLabel;         // 运行时错误出口
+    MIR_reg_t vm;                   // VM *
+    MIR_reg_t closure;              // ObjClosure *
+    MIR_reg_t frame;                // 本函数的CallFrame *
+    MIR_reg_t slots;                // frame->slots
+    MIR_reg_t consts;               // 常量数组
+    MIR_reg_t caches;               // 内联缓存数组
+    MIR_reg_t code;                 // 字节码数组 用于回写frame->ip
+    MIR_reg_t scratch;              // 8字节临时内存 用于值和double互转
+    MIR_reg_t *values;              // 栈槽(含局部变量)对应的整数寄存器
+    MIR_reg_t *numbers;             // 栈槽对应的双精度寄存器
+    uint8_t *kinds;                 // 当前各栈槽的SlotKind
+    bool *dirty;                    // 寄存器比vm栈里的值新
+    int depth;                      // 当前栈深度
+    int entryDepth;                 // 入口栈深度 闭包加参数
+    int maxDepth;                   // 最大栈深度
+    int regCount;                   // 临时寄存器计数
+} JitCompiler;
+
+#define INSN(code, ...)                                                        \
+    MIR_append_insn(jit->ctx, jit->func,                                       \
+                    MIR_new_insn(jit->ctx, code, __VA_ARGS__))
+#define REG(r) MIR_new_reg_op(jit->ctx, r)
+#define IMM(v) MIR_new_int_op(jit->ctx, (int64_t)(v))
+#define MEM(type, disp, base) MIR_new_mem_op(jit->ctx, type, disp, base, 0, 1)
+#define LABEL(l) MIR_new_label_op(jit->ctx, l)
+#define VALUE_MEM(disp, base) MEM(MIR_T_I64, disp, base)
+#define SLOT_MEM(type, index)                                                  \
+    MEM(type, (index) * (int)sizeof(Value), jit->slots)
+#define KINDS_AT(pc) (&jit->entryKinds[(pc) * (jit->maxDepth + 1)])
+
+// 新建临时寄存器 每次都用新寄存器 交给MIR做分配
+static MIR_reg_t newReg(JitCompiler *jit, MIR_type_t type) {
+    char name[16];
+    snprintf(name, sizeof(name), "t%d", jit->regCount++);
+    return MIR_new_func_reg(jit->ctx, jit->func->u.func, type, name);
+}
+
+static void emitLabel(JitCompiler *jit, MIR_label_t label) {
+    MIR_append_insn(jit->ctx, jit->func, label);
+}
+
+// 为模块声明所有运行时函数的原型和导入
+static void declareHelpers(JitCompiler *jit) {
+    static const char *argNames[] = {"a0", "a1", "a2"};
+    for (int id = 0; id < HELPER_COUNT; id++) {
+        LoxFunction *helper = &LoxFunctions[id];
+        char protoName[64];
+        MIR_var_t vars[3];
+        for (int i = 0; i < helper->argCount; i++) {
+            vars[i].type = helper->args[i];
+            vars[i].name = argNames[i];
+            vars[i].size = 0;
+        }
+        snprintf(protoName, sizeof(protoName), "%s_p", helper->name);
+        jit->protos[id] = MIR_new_proto_arr(
+            jit->ctx, protoName, helper->result == MIR_T_UNDEF ? 0 : 1,
+            &helper->result, helper->argCount, vars);
+        jit->imports[id] = MIR_new_import(jit->ctx, helper->name);
+    }
+}
+
+// 指令的后继 返回后继个数
+static int successors(Chunk *chunk, int pc, int *next) {
+    uint8_t *code = chunk->code;
+    // 只有跳转指令带两字节偏移 末尾的单字节指令后面没有可读的字节
+#define JUMP_OFFSET() ((code[pc + 1] << 8) | code[pc + 2])
+    switch (code[pc]) {
+    case OP_JUMP:
+        next[0] = pc + 3 + JUMP_OFFSET();
+        return 1;
+    case OP_JUMP_IF_FALSE:
+        next[0] = pc + 3;
+        next[1] = pc + 3 + JUMP_OFFSET();
+        return 2;
+    case OP_LOOP:
+        next[0] = pc + 3 - JUMP_OFFSET();
+        return 1;
+    case OP_RETURN:
+        return 0;
+    default:
+        next[0] = pc + instructionLength(chunk, pc);
+        return 1;
+    }
+#undef JUMP_OFFSET
+}
+
+// 抽象解释字节码 算出每条指令执行前的栈深度和最大栈深度
+// clox字节码中同一位置的栈深度总是固定的 所以栈槽可以固定映射到寄存器
+static void analyzeDepths(JitCompiler *jit) {
+    Chunk *chunk = &jit->chunk;
+    int *worklist = malloc(sizeof(int) * (chunk->count + 1));
+    int count = 0;
+
+    for (int i = 0; i <= chunk->count; i++) {
+        jit->depths[i] = -1;
+    }
+    jit->depths[0] = jit->entryDepth;
+    jit->maxDepth = jit->entryDepth;
+    worklist[count++] = 0;
+
+    while (count > 0) {
+        int pc = worklist[--count];
+        int depth = jit->depths[pc] + stackEffect(chunk, pc);
+        int next[2];
+        int nextCount = successors(chunk, pc, next);
+
+        if (depth > jit->maxDepth) {
+            jit->maxDepth = depth;
+        }
+        for (int i = 0; i < nextCount; i++) {
+            if (next[i] < chunk->count && jit->depths[next[i]] == -1) {
+                jit->depths[next[i]] = depth;
+                worklist[count++] = next[i];
+            }
+        }
+    }
+    free(worklist);
+}
+
+// 解释器在该算术指令上只见过数字 生成推测为数字的代码
+static bool speculates(JitCompiler *jit, int pc) {
+    return jit->typeProfile[pc] == TYPE_PROFILE_NUMBER;
+}
+
+// 一条指令对栈槽类型的影响 kinds为执行前的类型 就地改为执行后的类型
+static void transferKinds(JitCompiler *jit, int pc, uint8_t *kinds) {
+    Chunk *chunk = &jit->chunk;
+    uint8_t *code = chunk->code;
+    int depth = jit->depths[pc];
+
+    switch (code[pc]) {
+    case OP_CONSTANT:
+        kinds[depth] = IS_NUMBER(chunk->constants.values[code[pc + 1]])
+                           ? SLOT_NUMBER
+                           : SLOT_VALUE;
+        break;
+    case OP_GET_LOCAL:
+        kinds[depth] = kinds[code[pc + 1]];
+        break;
+    case OP_SET_LOCAL:
+        kinds[code[pc + 1]] = kinds[depth - 1];
+        break;
+    case OP_ADD:
+        // 推测失败时退回解释器 结果同样一定是数字
+        kinds[depth - 2] = speculates(jit, pc) || (kinds[depth - 2] == SLOT_NUMBER &&
+                                                 kinds[depth - 1] == SLOT_NUMBER)
+                               ? SLOT_NUMBER
+                               : SLOT_VALUE;
+        break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        // 操作数不是数字时已经报错 结果一定是数字
+        kinds[depth - 2] = SLOT_NUMBER;
+        break;
+    case OP_NEGATE:
+        kinds[depth - 1] = SLOT_NUMBER;
+        break;
+    default: {
+        // 其余指令的结果都当作任意值
+        int after = depth + stackEffect(chunk, pc);
+        int changed = after - 1;
+        switch (code[pc]) {
+        case OP_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            kinds[changed] = SLOT_VALUE;
+            break;
+        }
+        break;
+    }
+    }
+
+    // 被捕获的局部变量可能在调用中被闭包改写 始终当作任意值
+    for (int i = 0; i < jit->maxDepth; i++) {
+        if (jit->captured[i]) {
+            kinds[i] = SLOT_VALUE;
+        }
+    }
+}
+
+// 数据流分析栈槽类型 汇合处只有各条路径都是数字的栈槽才是数字
+static void analyzeKinds(JitCompiler *jit) {
+    Chunk *chunk = &jit->chunk;
+    int stride = jit->maxDepth + 1;
+    int *worklist = malloc(sizeof(int) * (chunk->count + 1));
+    bool *queued = calloc(chunk->count + 1, sizeof(bool));
+    uint8_t *kinds = malloc(stride);
+    int count = 0;
+
+    memset(jit->entryKinds, SLOT_VALUE, (chunk->count + 1) * stride);
+    worklist[count++] = 0;
+    queued[0] = true;
+
+    // 第一次到达某条指令时直接复制类型 之后只会从数字降为任意值
+    bool *visited = calloc(chunk->count + 1, sizeof(bool));
+    visited[0] = true;
+    while (count > 0) {
+        int pc = worklist[--count];
+        queued[pc] = false;
+        memcpy(kinds, KINDS_AT(pc), stride);
+        transferKinds(jit, pc, kinds);
+
+        int next[2];
+        int nextCount = successors(chunk, pc, next);
+        int depth = jit->depths[pc] + stackEffect(chunk, pc);
+        for (int i = 0; i < nextCount; i++) {
+            int target = next[i];
+            if (target >= chunk->count) {
+                continue;
+            }
+            uint8_t *entry = KINDS_AT(target);
+            bool changed = !visited[target];
+            for (int slot = 0; slot < depth; slot++) {
+                uint8_t kind = visited[target] && entry[slot] == SLOT_VALUE
+                                   ? SLOT_VALUE
+                                   : kinds[slot];
+                if (entry[slot] != kind) {
+                    entry[slot] = kind;
+                    changed = true;
+                }
+            }
+            visited[target] = true;
+            if (changed && !queued[target]) {
+                queued[target] = true;
+                worklist[count++] = target;
+            }
+        }
+    }
+    free(visited);
+    free(kinds);
+    free(queued);
+    free(worklist);
+}
+
+// 找出被闭包捕获的栈槽和被改写的参数
+static void analyzeSlots(JitCompiler *jit) {
+    Chunk *chunk = &jit->chunk;
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        uint8_t *code = &chunk->code[pc];
+        if (code[0] == OP_SET_LOCAL) {
+            jit->written[code[1]] = true;
+        } else if (code[0] == OP_CLOSURE) {
+            ObjFunction *function =
+                AS_FUNCTION(chunk->constants.values[code[1]]);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                if (code[2 + i * 2]) {
+                    jit->captured[code[3 + i * 2]] = true;
+                }
+            }
+        }
+    }
+}
+
+// 值的位模式转为double
+static void emitToNumber(JitCompiler *jit, MIR_reg_t number, MIR_op_t value) {
+    INSN(MIR_MOV, VALUE_MEM(0, jit->scratch), value);
+    INSN(MIR_DMOV, REG(number), MEM(MIR_T_D, 0, jit->scratch));
+}
+
+// double转为值的位模式
+static void emitFromNumber(JitCompiler *jit, MIR_reg_t value,
+                           MIR_op_t number) {
+    INSN(MIR_DMOV, MEM(MIR_T_D, 0, jit->scratch), number);
+    INSN(MIR_MOV, REG(value), VALUE_MEM(0, jit->scratch));
+}
+
+// 把数字栈槽装箱到整数寄存器 vm栈中的值没过期时直接读取
+static void boxSlot(JitCompiler *jit, int index) {
+    if (jit->kinds[index] == SLOT_VALUE) {
+        return;
+    }
+    if (jit->dirty[index]) {
+        emitFromNumber(jit, jit->values[index], REG(jit->numbers[index]));
+    } else {
+        INSN(MIR_MOV, REG(jit->values[index]), SLOT_MEM(MIR_T_I64, index));
+    }
+    jit->kinds[index] = SLOT_VALUE;
+}
+
+// 把已知是数字的栈槽拆箱到双精度寄存器
+static void unboxSlot(JitCompiler *jit, int index) {
+    if (jit->kinds[index] == SLOT_NUMBER) {
+        return;
+    }
+    if (jit->dirty[index]) {
+        emitToNumber(jit, jit->numbers[index], REG(jit->values[index]));
+    } else {
+        INSN(MIR_DMOV, REG(jit->numbers[index]), SLOT_MEM(MIR_T_D, index));
+    }
+    jit->kinds[index] = SLOT_NUMBER;
+}
+
+// 栈槽转成目标指令入口处的表示 跳转和落入标签前使用
+static void reconcileKinds(JitCompiler *jit, int target) {
+    uint8_t *kinds = KINDS_AT(target);
+    for (int i = 0; i < jit->depths[target]; i++) {
+        if (kinds[i] == SLOT_NUMBER) {
+            unboxSlot(jit, i);
+        } else {
+            boxSlot(jit, i);
+        }
+    }
+}
+
+// 进入标签 多条路径汇合 不知道哪些栈槽已经写回
+// 没被改写过的参数和vm栈始终一致
+static void enterLabel(JitCompiler *jit, int pc) {
+    memcpy(jit->kinds, KINDS_AT(pc), jit->depth);
+    for (int i = 0; i < jit->depth; i++) {
+        jit->dirty[i] = i >= jit->entryDepth || jit->written[i];
+    }
+}
+
+// 把比内存新的栈槽写回vm栈
+static void spillSlots(JitCompiler *jit) {
+    for (int i = 0; i < jit->depth; i++) {
+        if (!jit->dirty[i]) {
+            continue;
+        }
+        if (jit->kinds[i] == SLOT_NUMBER) {
+            INSN(MIR_DMOV, SLOT_MEM(MIR_T_D, i), REG(jit->numbers[i]));
+        } else {
+            INSN(MIR_MOV, SLOT_MEM(MIR_T_I64, i), REG(jit->values[i]));
+        }
+        jit->dirty[i] = false;
+    }
+}
+
+// 从vm栈重新读取一个栈槽
+static void reloadSlot(JitCompiler *jit, int index) {
+    INSN(MIR_MOV, REG(jit->values[index]), SLOT_MEM(MIR_T_I64, index));
+    jit->kinds[index] = SLOT_VALUE;
+    jit->dirty[index] = false;
+}
+
+// 栈槽状态快照 用于在分支另一侧生成代码后恢复
+typedef struct {
+    int depth;
+    uint8_t *kinds;
+    bool *dirty;
+} SlotState;
+
+static void saveSlots(JitCompiler *jit, SlotState *state) {
+    state->depth = jit->depth;
+    state->kinds = malloc(jit->depth);
+    state->dirty = malloc(jit->depth * sizeof(bool));
+    memcpy(state->kinds, jit->kinds, jit->depth);
+    memcpy(state->dirty, jit->dirty, jit->depth * sizeof(bool));
+}
+
+// 恢复快照并释放
+static void restoreSlots(JitCompiler *jit, SlotState *state) {
+    jit->depth = state->depth;
+    memcpy(jit->kinds, state->kinds, state->depth);
+    memcpy(jit->dirty, state->dirty, state->depth * sizeof(bool));
+    free(state->kinds);
+    free(state->dirty);
+}
+
+// 调用运行时前 写回栈槽 并回写frame->ip(报错行号)和栈顶
+// 运行时函数可能触发GC或报错 此时vm栈必须完整
+static void beginCall(JitCompiler *jit, int pc) {
+    MIR_reg_t ip = newReg(jit, MIR_T_I64);
+    MIR_reg_t top = newReg(jit, MIR_T_I64);
+    spillSlots(jit);
+    INSN(MIR_ADD, REG(ip), REG(jit->code), IMM(pc + 1));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, ip), jit->frame), REG(ip));
+    INSN(MIR_ADD, REG(top), REG(jit->slots), IMM(jit->depth * sizeof(Value)));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(VM, stackTop), jit->vm), REG(top));
+}
+
+// 调用运行时函数 result在无返回值时忽略
+static void emitCallArgs(JitCompiler *jit, HelperId id, MIR_reg_t result,
+                         int argCount, va_list args) {
+    MIR_op_t ops[8];
+    int count = 0;
+    ops[count++] = MIR_new_ref_op(jit->ctx, jit->protos[id]);
+    ops[count++] = MIR_new_ref_op(jit->ctx, jit->imports[id]);
+    if (LoxFunctions[id].result != MIR_T_UNDEF) {
+        ops[count++] = REG(result);
+    }
+    for (int i = 0; i < argCount; i++) {
+        ops[count++] = va_arg(args, MIR_op_t);
+    }
+
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_insn_arr(jit->ctx, MIR_CALL, count, ops));
+}
+
+static void emitCall(JitCompiler *jit, HelperId id, MIR_reg_t result,
+                     int argCount, ...) {
+    va_list args;
+    va_start(args, argCount);
+    emitCallArgs(jit, id, result, argCount, args);
+    va_end(args);
+}
+
+// 调用返回bool的运行时函数并检查结果
+// 调用后栈深度变为depth 从result开始的栈槽是运行时写入的结果
+static void emitCheckedCall(JitCompiler *jit, int pc, HelperId id, int depth,
+                            int result, int argCount, ...) {
+    MIR_reg_t ok = newReg(jit, MIR_T_I64);
+    beginCall(jit, pc);
+    va_list args;
+    va_start(args, argCount);
+    emitCallArgs(jit, id, ok, argCount, args);
+    va_end(args);
+    INSN(MIR_BF, LABEL(jit->errorLabel), REG(ok));
+
+    jit->depth = depth;
+    for (int i = result; i < depth; i++) {
+        reloadSlot(jit, i);
+    }
+    // 被调用的Lox代码可能通过提升值改写本函数被捕获的局部变量
+    if (id == HELPER_CALL_VALUE || id == HELPER_INVOKE ||
+        id == HELPER_SUPER_INVOKE) {
+        for (int i = 0; i < result; i++) {
+            if (jit->captured[i]) {
+                reloadSlot(jit, i);
+            }
+        }
+    }
+}
+
+// 栈上第distance个值的下标 peek(0)为栈顶
+static int stackIndex(JitCompiler *jit, int distance) {
+    return jit->depth - 1 - distance;
+}
+
+// 装箱后的栈值 用于传给运行时或比较位模式
+static MIR_op_t stackValue(JitCompiler *jit, int distance) {
+    int index = stackIndex(jit, distance);
+    boxSlot(jit, index);
+    return REG(jit->values[index]);
+}
+
+static void setValue(JitCompiler *jit, int index, MIR_op_t value) {
+    INSN(MIR_MOV, REG(jit->values[index]), value);
+    jit->kinds[index] = SLOT_VALUE;
+    jit->dirty[index] = true;
+}
+
+static void setNumber(JitCompiler *jit, int index, MIR_op_t number) {
+    INSN(MIR_DMOV, REG(jit->numbers[index]), number);
+    jit->kinds[index] = SLOT_NUMBER;
+    jit->dirty[index] = true;
+}
+
+// 把栈槽from复制到栈槽to 保持原来的表示
+static void copySlot(JitCompiler *jit, int to, int from) {
+    if (jit->kinds[from] == SLOT_NUMBER) {
+        setNumber(jit, to, REG(jit->numbers[from]));
+    } else {
+        setValue(jit, to, REG(jit->values[from]));
+    }
+}
+
+static void pushValue(JitCompiler *jit, MIR_op_t value) {
+    setValue(jit, jit->depth++, value);
+}
+
+static void emitDrop(JitCompiler *jit, int count) { jit->depth -= count; }
+
+// 读取对象常量并转成对象指针
+static MIR_op_t emitObjConstant(JitCompiler *jit, int index) {
+    MIR_reg_t reg = newReg(jit, MIR_T_I64);
+    INSN(MIR_MOV, REG(reg), VALUE_MEM(index * sizeof(Value), jit->consts));
+    INSN(MIR_AND, REG(reg), REG(reg), IMM(~(SIGN_BIT | QNAN)));
+    return REG(reg);
+}
+
+// 全局变量名 只在报错时读取
+static MIR_op_t emitGlobalName(JitCompiler *jit, int slot) {
+    MIR_reg_t reg = newReg(jit, MIR_T_I64);
+    INSN(MIR_MOV, REG(reg),
+         MEM(MIR_T_P, offsetof(VM, globalNames) + offsetof(ValueArray, values),
+             jit->vm));
+    INSN(MIR_MOV, REG(reg), VALUE_MEM(slot * sizeof(Value), reg));
+    INSN(MIR_AND, REG(reg), REG(reg), IMM(~(SIGN_BIT | QNAN)));
+    return REG(reg);
+}
+
+// 指令操作数指定的内联缓存 和解释器共用同一份记录
+static MIR_op_t emitInlineCache(JitCompiler *jit, int operand) {
+    uint8_t *code = jit->chunk.code;
+    int index = (code[operand] << 8) | code[operand + 1];
+    MIR_reg_t reg = newReg(jit, MIR_T_I64);
+    INSN(MIR_ADD, REG(reg), REG(jit->caches),
+         IMM(index * (int)sizeof(InlineCache)));
+    return REG(reg);
+}
+
+// 内联缓存首项命中字段时的字段地址 否则跳转到slow
+// 只检查首项 单态的属性访问不用调用运行时
+static MIR_op_t emitFieldAccess(JitCompiler *jit, MIR_op_t receiver,
+                                MIR_op_t cache, MIR_label_t slow) {
+    MIR_reg_t entry = newReg(jit, MIR_T_I64);
+    MIR_reg_t object = newReg(jit, MIR_T_I64);
+    MIR_reg_t temp = newReg(jit, MIR_T_I64);
+    MIR_reg_t shape = newReg(jit, MIR_T_I64);
+    MIR_reg_t index = newReg(jit, MIR_T_I64);
+    MIR_reg_t fields = newReg(jit, MIR_T_I64);
+    INSN(MIR_AND, REG(temp), receiver, IMM(SIGN_BIT | QNAN));
+    INSN(MIR_BNE, LABEL(slow), REG(temp), IMM(SIGN_BIT | QNAN));
+    INSN(MIR_AND, REG(object), receiver, IMM(~(SIGN_BIT | QNAN)));
+    INSN(MIR_MOV, REG(temp), MEM(MIR_T_I32, offsetof(Obj, type), object));
+    INSN(MIR_BNE, LABEL(slow), REG(temp), IMM(OBJ_INSTANCE));
+
+    // 形状相同且首项是字段项(不是方法项也不是新增字段项)
+    INSN(MIR_MOV, REG(entry), cache);
+    INSN(MIR_MOV, REG(shape),
+         MEM(MIR_T_P, offsetof(ObjInstance, shape), object));
+    INSN(MIR_MOV, REG(temp),
+         MEM(MIR_T_P, offsetof(InlineCacheEntry, shape), entry));
+    INSN(MIR_BNE, LABEL(slow), REG(shape), REG(temp));
+    INSN(MIR_MOV, REG(temp),
+         MEM(MIR_T_P, offsetof(InlineCacheEntry, transition), entry));
+    INSN(MIR_BNE, LABEL(slow), REG(temp), IMM(0));
+    INSN(MIR_MOV, REG(index),
+         MEM(MIR_T_I32, offsetof(InlineCacheEntry, index), entry));
+    INSN(MIR_BLT, LABEL(slow), REG(index), IMM(0));
+    INSN(MIR_MOV, REG(fields),
+         MEM(MIR_T_P, offsetof(ObjInstance, fields), object));
+    return MIR_new_mem_op(jit->ctx, MIR_T_I64, 0, fields, index,
+                          sizeof(Value));
+}
+
+// 写屏障 object是老对象而value是新对象时把object记入记忆集
+// 新建的实例和非对象值在前两个判断就跳过 不用调用运行时
+static void emitWriteBarrier(JitCompiler *jit, MIR_op_t object,
+                             MIR_op_t value) {
+    MIR_label_t done = MIR_new_label(jit->ctx);
+    MIR_reg_t temp = newReg(jit, MIR_T_I64);
+    MIR_reg_t target = newReg(jit, MIR_T_I64);
+    MIR_reg_t base = newReg(jit, MIR_T_I64);
+    INSN(MIR_MOV, REG(base), object);
+    INSN(MIR_MOV, REG(temp), MEM(MIR_T_U8, offsetof(Obj, isMarked), base));
+    INSN(MIR_BEQ, LABEL(done), REG(temp), IMM(0));
+    INSN(MIR_AND, REG(temp), value, IMM(SIGN_BIT | QNAN));
+    INSN(MIR_BNE, LABEL(done), REG(temp), IMM(SIGN_BIT | QNAN));
+    INSN(MIR_AND, REG(target), value, IMM(~(SIGN_BIT | QNAN)));
+    INSN(MIR_MOV, REG(temp), MEM(MIR_T_U8, offsetof(Obj, isMarked), target));
+    INSN(MIR_BNE, LABEL(done), REG(temp), IMM(0));
+    emitCall(jit, HELPER_REMEMBER_OBJECT, 0, 1, REG(base));
+    emitLabel(jit, done);
+}
+
+// 栈值不是数字时跳转 已知是数字的不检查
+static void emitNumberCheck(JitCompiler *jit, int distance, MIR_label_t fail) {
+    int index = stackIndex(jit, distance);
+    if (jit->kinds[index] == SLOT_NUMBER) {
+        return;
+    }
+    MIR_reg_t tag = newReg(jit, MIR_T_I64);
+    INSN(MIR_AND, REG(tag), REG(jit->values[index]), IMM(QNAN));
+    INSN(MIR_BEQ, LABEL(fail), REG(tag), IMM(QNAN));
+}
+
+// 检查过类型的栈值 拆箱后的双精度寄存器
+static MIR_op_t stackNumber(JitCompiler *jit, int distance) {
+    int index = stackIndex(jit, distance);
+    unboxSlot(jit, index);
+    return REG(jit->numbers[index]);
+}
+
+// 报告运行时错误并返回 INTERPRET_RUNTIME_ERROR
+// 栈会被重置 所以只需要回写frame->ip
+static void emitError(JitCompiler *jit, int pc, JitError error,
+                      MIR_op_t name) {
+    MIR_reg_t ip = newReg(jit, MIR_T_I64);
+    INSN(MIR_ADD, REG(ip), REG(jit->code), IMM(pc + 1));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, ip), jit->frame), REG(ip));
+    emitCall(jit, HELPER_JIT_RUNTIME_ERROR, 0, 2, IMM(error), name);
+    INSN(MIR_JMP, LABEL(jit->errorLabel));
+}
+
+// 退优化 栈槽全部写回vm栈 栈帧留给解释器从pc处的指令重新执行
+static void emitDeopt(JitCompiler *jit, int pc) {
+    MIR_reg_t ip = newReg(jit, MIR_T_I64);
+    MIR_reg_t top = newReg(jit, MIR_T_I64);
+    MIR_reg_t function = newReg(jit, MIR_T_I64);
+    spillSlots(jit);
+    INSN(MIR_ADD, REG(ip), REG(jit->code), IMM(pc));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, ip), jit->frame), REG(ip));
+    INSN(MIR_ADD, REG(top), REG(jit->slots), IMM(jit->depth * sizeof(Value)));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(VM, stackTop), jit->vm), REG(top));
+    INSN(MIR_MOV, REG(function),
+         MEM(MIR_T_P, offsetof(ObjClosure, function), jit->closure));
+    emitCall(jit, HELPER_DEOPTIMIZE, 0, 1, REG(function));
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_ret_insn(jit->ctx, 1, IMM(INTERPRET_DEOPT)));
+}
+
+// 类型检查失败的出口 state为检查前的栈槽状态
+// 推测过的指令退回解释器 否则直接报错
+static void emitCheckFailure(JitCompiler *jit, int pc, SlotState *state,
+                             JitError error) {
+    if (!speculates(jit, pc)) {
+        free(state->kinds);
+        free(state->dirty);
+        emitError(jit, pc, error, IMM(0));
+        return;
+    }
+    SlotState current;
+    saveSlots(jit, &current);
+    restoreSlots(jit, state);
+    emitDeopt(jit, pc);
+    restoreSlots(jit, &current);
+}
+
+// 数字二元运算 op为MIR双精度指令 比较指令的结果转为布尔值
+static void emitBinaryOp(JitCompiler *jit, int pc, MIR_insn_code_t op,
+                         bool isCompare) {
+    MIR_label_t fail = MIR_new_label(jit->ctx);
+    MIR_label_t done = MIR_new_label(jit->ctx);
+    SlotState state;
+    saveSlots(jit, &state);
+    emitNumberCheck(jit, 0, fail);
+    emitNumberCheck(jit, 1, fail);
+
+    MIR_op_t a = stackNumber(jit, 1);
+    MIR_op_t b = stackNumber(jit, 0);
+    int index = stackIndex(jit, 1);
+    if (isCompare) {
+        MIR_reg_t result = newReg(jit, MIR_T_I64);
+        INSN(op, REG(result), a, b);
+        INSN(MIR_ADD, REG(result), REG(result), IMM(FALSE_VAL));
+        setValue(jit, index, REG(result));
+    } else {
+        MIR_reg_t result = newReg(jit, MIR_T_D);
+        INSN(op, REG(result), a, b);
+        setNumber(jit, index, REG(result));
+    }
+    INSN(MIR_JMP, LABEL(done));
+
+    emitLabel(jit, fail);
+    emitCheckFailure(jit, pc, &state, JIT_ERROR_NUMBERS);
+    emitLabel(jit, done);
+    emitDrop(jit, 1);
+}
+
+// 假值判断 nil和false为假 结果为0或1
+static MIR_reg_t emitFalsey(JitCompiler *jit, MIR_op_t value) {
+    MIR_reg_t isNil = newReg(jit, MIR_T_I64);
+    MIR_reg_t isFalse = newReg(jit, MIR_T_I64);
+    INSN(MIR_EQ, REG(isNil), value, MIR_new_uint_op(jit->ctx, NIL_VAL));
+    INSN(MIR_EQ, REG(isFalse), value, MIR_new_uint_op(jit->ctx, FALSE_VAL));
+    INSN(MIR_OR, REG(isNil), REG(isNil), REG(isFalse));
+    return isNil;
+}
+
+// 读取函数的字节码和常量数组
+static void emitLoadFunction(JitCompiler *jit) {
+    MIR_reg_t function = newReg(jit, MIR_T_I64);
+    INSN(MIR_MOV, REG(function),
+         MEM(MIR_T_P, offsetof(ObjClosure, function), jit->closure));
+    INSN(MIR_MOV, REG(jit->code),
+         MEM(MIR_T_P, offsetof(ObjFunction, chunk.code), function));
+    INSN(MIR_MOV, REG(jit->consts),
+         MEM(MIR_T_P, offsetof(ObjFunction, chunk.constants.values), function));
+    INSN(MIR_MOV, REG(jit->caches),
+         MEM(MIR_T_P, offsetof(ObjFunction, inlineCaches), function));
+    INSN(MIR_ALLOCA, REG(jit->scratch), IMM(sizeof(Value)));
+}
+
+// 函数入口 压入调用帧并把参数读入寄存器
+static void emitPrologue(JitCompiler *jit) {
+    MIR_reg_t count = newReg(jit, MIR_T_I64);
+
+    INSN(MIR_MOV, REG(count), MEM(MIR_T_I32, offsetof(VM, frameCount), jit->vm));
+    INSN(MIR_MUL, REG(jit->frame), REG(count), IMM(sizeof(CallFrame)));
+    INSN(MIR_ADD, REG(jit->frame), REG(jit->frame), REG(jit->vm));
+    INSN(MIR_ADD, REG(jit->frame), REG(jit->frame), IMM(offsetof(VM, frames)));
+    INSN(MIR_ADD, REG(count), REG(count), IMM(1));
+    INSN(MIR_MOV, MEM(MIR_T_I32, offsetof(VM, frameCount), jit->vm), REG(count));
+
+    emitLoadFunction(jit);
+    INSN(MIR_MOV, REG(jit->slots), MEM(MIR_T_P, offsetof(VM, stackTop), jit->vm));
+    INSN(MIR_SUB, REG(jit->slots), REG(jit->slots),
+         IMM(jit->entryDepth * sizeof(Value)));
+
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, closure), jit->frame),
+         REG(jit->closure));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, ip), jit->frame),
+         REG(jit->code));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(CallFrame, slots), jit->frame),
+         REG(jit->slots));
+
+    jit->depth = jit->entryDepth;
+    for (int i = 0; i < jit->depth; i++) {
+        reloadSlot(jit, i);
+    }
+}
+
+// OSR入口 沿用解释器正在执行的栈帧 按frame->ip跳到对应的循环头
+static void emitOsrPrologue(JitCompiler *jit) {
+    MIR_reg_t count = newReg(jit, MIR_T_I64);
+    MIR_reg_t pc = newReg(jit, MIR_T_I64);
+
+    INSN(MIR_MOV, REG(count), MEM(MIR_T_I32, offsetof(VM, frameCount), jit->vm));
+    INSN(MIR_SUB, REG(count), REG(count), IMM(1));
+    INSN(MIR_MUL, REG(jit->frame), REG(count), IMM(sizeof(CallFrame)));
+    INSN(MIR_ADD, REG(jit->frame), REG(jit->frame), REG(jit->vm));
+    INSN(MIR_ADD, REG(jit->frame), REG(jit->frame), IMM(offsetof(VM, frames)));
+
+    emitLoadFunction(jit);
+    INSN(MIR_MOV, REG(jit->slots),
+         MEM(MIR_T_P, offsetof(CallFrame, slots), jit->frame));
+
+    INSN(MIR_MOV, REG(pc), MEM(MIR_T_P, offsetof(CallFrame, ip), jit->frame));
+    INSN(MIR_SUB, REG(pc), REG(pc), REG(jit->code));
+    Chunk *chunk = &jit->chunk;
+    for (int i = 0; i < chunk->count; i += instructionLength(chunk, i)) {
+        if (chunk->code[i] != OP_LOOP || jit->depths[i] == -1) {
+            continue;
+        }
+        // 按循环头处的表示从vm栈读入所有栈槽后进入循环
+        // 推测为数字的栈槽要先检查 解释器这次算出的可能不是数字
+        int target = i + 3 - ((chunk->code[i + 1] << 8) | chunk->code[i + 2]);
+        MIR_label_t skip = MIR_new_label(jit->ctx);
+        MIR_label_t deopt = MIR_new_label(jit->ctx);
+        INSN(MIR_BNE, LABEL(skip), REG(pc), IMM(target));
+        jit->depth = jit->depths[target];
+        for (int slot = 0; slot < jit->depth; slot++) {
+            reloadSlot(jit, slot);
+            if (KINDS_AT(target)[slot] == SLOT_NUMBER) {
+                emitNumberCheck(jit, jit->depth - 1 - slot, deopt);
+            }
+        }
+        reconcileKinds(jit, target);
+        INSN(MIR_JMP, LABEL(jit->labels[target]));
+        // vm栈就是解释器的状态 不用写回
+        emitLabel(jit, deopt);
+        memset(jit->kinds, SLOT_VALUE, jit->depth);
+        memset(jit->dirty, false, jit->depth * sizeof(bool));
+        emitDeopt(jit, target);
+        emitLabel(jit, skip);
+    }
+    // 不是循环头 不会发生
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_ret_insn(jit->ctx, 1, IMM(INTERPRET_RUNTIME_ERROR)));
+}
+
+// 函数返回 与解释器的OP_RETURN一致
+static void emitReturn(JitCompiler *jit, int pc) {
+    MIR_op_t result = stackValue(jit, 0);
+    MIR_reg_t count = newReg(jit, MIR_T_I64);
+    MIR_label_t notTop = MIR_new_label(jit->ctx);
+
+    // 关闭提升值前局部变量要先写回vm栈
+    beginCall(jit, pc);
+    emitCall(jit, HELPER_CLOSE_UPVALUES, 0, 1, REG(jit->slots));
+
+    INSN(MIR_MOV, REG(count), MEM(MIR_T_I32, offsetof(VM, frameCount), jit->vm));
+    INSN(MIR_SUB, REG(count), REG(count), IMM(1));
+    INSN(MIR_MOV, MEM(MIR_T_I32, offsetof(VM, frameCount), jit->vm), REG(count));
+    INSN(MIR_BNE, LABEL(notTop), REG(count), IMM(0));
+    // 顶层脚本 弹出脚本闭包
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(VM, stackTop), jit->vm),
+         REG(jit->slots));
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_ret_insn(jit->ctx, 1, IMM(INTERPRET_OK)));
+
+    emitLabel(jit, notTop);
+    MIR_reg_t top = newReg(jit, MIR_T_I64);
+    INSN(MIR_MOV, SLOT_MEM(MIR_T_I64, 0), result);
+    INSN(MIR_ADD, REG(top), REG(jit->slots), IMM(sizeof(Value)));
+    INSN(MIR_MOV, MEM(MIR_T_P, offsetof(VM, stackTop), jit->vm), REG(top));
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_ret_insn(jit->ctx, 1, IMM(INTERPRET_OK)));
+}
+
+// 收集跳转目标 为它们建立标签
+static void collectLabels(JitCompiler *jit) {
+    Chunk *chunk = &jit->chunk;
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        uint8_t instruction = chunk->code[pc];
+        if (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE &&
+            instruction != OP_LOOP) {
+            continue;
+        }
+        uint16_t offset =
+            (uint16_t)((chunk->code[pc + 1] << 8) | chunk->code[pc + 2]);
+        int target = instruction == OP_LOOP ? pc + 3 - offset : pc + 3 + offset;
+        if (jit->labels[target] == NULL) {
+            jit->labels[target] = MIR_new_label(jit->ctx);
+        }
+    }
+}
+
+// 跳转到target 先把栈槽转成目标处的表示
+static void emitJump(JitCompiler *jit, int target) {
+    reconcileKinds(jit, target);
+    INSN(MIR_JMP, LABEL(jit->labels[target]));
+}
+
+// 逐条翻译字节码为MIR指令
+// 栈槽都在寄存器中 只在调用运行时前写回vm栈
+static void translate(JitCompiler *jit) {
+    Chunk *chunk = &jit->chunk;
+    uint8_t *code = chunk->code;
+    bool fallsThrough = false;
+
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        // 不可达的指令 例如return之后编译器补的OP_NIL OP_RETURN
+        if (jit->depths[pc] == -1) {
+            fallsThrough = false;
+            continue;
+        }
+        if (jit->labels[pc] != NULL) {
+            if (fallsThrough) {
+                reconcileKinds(jit, pc);
+            }
+            jit->depth = jit->depths[pc];
+            emitLabel(jit, jit->labels[pc]);
+            enterLabel(jit, pc);
+        }
+        jit->depth = jit->depths[pc];
+        fallsThrough = true;
+
+        switch (code[pc]) {
+        case OP_CONSTANT: {
+            Value value = chunk->constants.values[code[pc + 1]];
+            if (IS_NUMBER(value)) {
+                setNumber(jit, jit->depth++,
+                          MIR_new_double_op(jit->ctx, AS_NUMBER(value)));
+            } else {
+                MIR_reg_t reg = newReg(jit, MIR_T_I64);
+                INSN(MIR_MOV, REG(reg),
+                     VALUE_MEM(code[pc + 1] * sizeof(Value), jit->consts));
+                pushValue(jit, REG(reg));
+            }
+            break;
+        }
+        case OP_NIL:
+            pushValue(jit, MIR_new_uint_op(jit->ctx, NIL_VAL));
+            break;
+        case OP_TRUE:
+            pushValue(jit, MIR_new_uint_op(jit->ctx, TRUE_VAL));
+            break;
+        case OP_FALSE:
+            pushValue(jit, MIR_new_uint_op(jit->ctx, FALSE_VAL));
+            break;
+        case OP_POP:
+            emitDrop(jit, 1);
+            break;
+        case OP_GET_LOCAL:
+            copySlot(jit, jit->depth++, code[pc + 1]);
+            break;
+        case OP_SET_LOCAL:
+            copySlot(jit, code[pc + 1], stackIndex(jit, 0));
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: {
+            // 全局变量数组可能在编译新代码时扩容 每次都从VM重新读取
+            int slot = (code[pc + 1] << 8) | code[pc + 2];
+            MIR_reg_t values = newReg(jit, MIR_T_I64);
+            INSN(MIR_MOV, REG(values),
+                 MEM(MIR_T_P,
+                     offsetof(VM, globalValues) + offsetof(ValueArray, values),
+                     jit->vm));
+            MIR_op_t global = VALUE_MEM(slot * sizeof(Value), values);
+            if (code[pc] == OP_DEFINE_GLOBAL) {
+                INSN(MIR_MOV, global, stackValue(jit, 0));
+                emitDrop(jit, 1);
+                break;
+            }
+
+            MIR_label_t defined = MIR_new_label(jit->ctx);
+            MIR_reg_t value = newReg(jit, MIR_T_I64);
+            INSN(MIR_MOV, REG(value), global);
+            INSN(MIR_BNE, LABEL(defined), REG(value), IMM(UNDEFINED_VAL));
+            emitError(jit, pc, JIT_ERROR_UNDEFINED, emitGlobalName(jit, slot));
+            emitLabel(jit, defined);
+            if (code[pc] == OP_GET_GLOBAL) {
+                pushValue(jit, REG(value));
+            } else {
+                INSN(MIR_MOV, global, stackValue(jit, 0));
+            }
+            break;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE: {
+            // 提升值只指向外层函数的栈槽 外层函数调用本函数前已经写回
+            MIR_reg_t upvalue = newReg(jit, MIR_T_I64);
+            MIR_reg_t location = newReg(jit, MIR_T_I64);
+            INSN(MIR_MOV, REG(upvalue),
+                 MEM(MIR_T_P, offsetof(ObjClosure, upvalues), jit->closure));
+            INSN(MIR_MOV, REG(upvalue),
+                 MEM(MIR_T_P, code[pc + 1] * sizeof(ObjUpvalue *), upvalue));
+            INSN(MIR_MOV, REG(location),
+                 MEM(MIR_T_P, offsetof(ObjUpvalue, location), upvalue));
+            if (code[pc] == OP_GET_UPVALUE) {
+                pushValue(jit, VALUE_MEM(0, location));
+            } else {
+                INSN(MIR_MOV, VALUE_MEM(0, location), stackValue(jit, 0));
+                // 已关闭的提升值把值存在自己的closed里
+                emitWriteBarrier(jit, REG(upvalue), stackValue(jit, 0));
+            }
+            break;
+        }
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY: {
+            // 缓存命中字段时直接读写 其余交给运行时 写法同OP_ADD
+            bool get = code[pc] == OP_GET_PROPERTY;
+            MIR_label_t slow = MIR_new_label(jit->ctx);
+            MIR_label_t done = MIR_new_label(jit->ctx);
+            MIR_op_t cache = emitInlineCache(jit, pc + 2);
+            MIR_op_t receiver = stackValue(jit, get ? 0 : 1);
+            MIR_op_t value = get ? receiver : stackValue(jit, 0);
+            SlotState before, after;
+            saveSlots(jit, &before);
+            MIR_op_t field = emitFieldAccess(jit, receiver, cache, slow);
+            if (get) {
+                setValue(jit, stackIndex(jit, 0), field);
+            } else {
+                MIR_reg_t object = newReg(jit, MIR_T_I64);
+                INSN(MIR_MOV, field, value);
+                INSN(MIR_AND, REG(object), receiver, IMM(~(SIGN_BIT | QNAN)));
+                emitWriteBarrier(jit, REG(object), value);
+                setValue(jit, stackIndex(jit, 1), value);
+                emitDrop(jit, 1);
+            }
+            saveSlots(jit, &after);
+            INSN(MIR_JMP, LABEL(done));
+
+            emitLabel(jit, slow);
+            restoreSlots(jit, &before);
+            emitCheckedCall(jit, pc,
+                            get ? HELPER_GET_PROPERTY : HELPER_SET_PROPERTY,
+                            get ? jit->depth : jit->depth - 1,
+                            get ? jit->depth - 1 : jit->depth - 2, 2,
+                            emitObjConstant(jit, code[pc + 1]), cache);
+            restoreSlots(jit, &after);
+            emitLabel(jit, done);
+            break;
+        }
+        case OP_GET_SUPER:
+            emitCheckedCall(jit, pc, HELPER_GET_SUPER, jit->depth - 1,
+                            jit->depth - 2, 1,
+                            emitObjConstant(jit, code[pc + 1]));
+            break;
+        case OP_EQUAL: {
+            MIR_reg_t result = newReg(jit, MIR_T_I64);
+            int a = stackIndex(jit, 1);
+            int b = stackIndex(jit, 0);
+            if (jit->kinds[a] == SLOT_NUMBER && jit->kinds[b] == SLOT_NUMBER) {
+                INSN(MIR_DEQ, REG(result), REG(jit->numbers[a]),
+                     REG(jit->numbers[b]));
+            } else {
+                // 两边都是数字时按浮点比较 否则比较位模式
+                MIR_label_t bits = MIR_new_label(jit->ctx);
+                MIR_label_t done = MIR_new_label(jit->ctx);
+                MIR_reg_t x = newReg(jit, MIR_T_D);
+                MIR_reg_t y = newReg(jit, MIR_T_D);
+                MIR_op_t left = stackValue(jit, 1);
+                MIR_op_t right = stackValue(jit, 0);
+                emitNumberCheck(jit, 0, bits);
+                emitNumberCheck(jit, 1, bits);
+                emitToNumber(jit, x, left);
+                emitToNumber(jit, y, right);
+                INSN(MIR_DEQ, REG(result), REG(x), REG(y));
+                INSN(MIR_JMP, LABEL(done));
+                emitLabel(jit, bits);
+                // 位模式不同的两个对象可能是内容相同的字符串
+                MIR_reg_t tag = newReg(jit, MIR_T_I64);
+                INSN(MIR_EQ, REG(result), left, right);
+                INSN(MIR_BNE, LABEL(done), REG(result), IMM(0));
+                INSN(MIR_AND, REG(tag), left, IMM(SIGN_BIT | QNAN));
+                INSN(MIR_BNE, LABEL(done), REG(tag), IMM(SIGN_BIT | QNAN));
+                INSN(MIR_AND, REG(tag), right, IMM(SIGN_BIT | QNAN));
+                INSN(MIR_BNE, LABEL(done), REG(tag), IMM(SIGN_BIT | QNAN));
+                emitCall(jit, HELPER_VALUES_EQUAL, result, 2, left, right);
+                emitLabel(jit, done);
+            }
+            INSN(MIR_ADD, REG(result), REG(result), IMM(FALSE_VAL));
+            setValue(jit, a, REG(result));
+            emitDrop(jit, 1);
+            break;
+        }
+        case OP_GREATER:
+            emitBinaryOp(jit, pc, MIR_DGT, true);
+            break;
+        case OP_LESS:
+            emitBinaryOp(jit, pc, MIR_DLT, true);
+            break;
+        case OP_ADD: {
+            int a = stackIndex(jit, 1);
+            int b = stackIndex(jit, 0);
+            if (speculates(jit, pc) || (jit->kinds[a] == SLOT_NUMBER &&
+                                        jit->kinds[b] == SLOT_NUMBER)) {
+                emitBinaryOp(jit, pc, MIR_DADD, false);
+                break;
+            }
+            // 数字走内联路径 其余交给运行时 结果都装箱
+            MIR_label_t slow = MIR_new_label(jit->ctx);
+            MIR_label_t done = MIR_new_label(jit->ctx);
+            MIR_reg_t sum = newReg(jit, MIR_T_D);
+            MIR_reg_t value = newReg(jit, MIR_T_I64);
+            SlotState before, after;
+            saveSlots(jit, &before);
+            emitNumberCheck(jit, 0, slow);
+            emitNumberCheck(jit, 1, slow);
+            INSN(MIR_DADD, REG(sum), stackNumber(jit, 1), stackNumber(jit, 0));
+            emitFromNumber(jit, value, REG(sum));
+            setValue(jit, a, REG(value));
+            emitDrop(jit, 1);
+            saveSlots(jit, &after);
+            INSN(MIR_JMP, LABEL(done));
+
+            // 慢路径从检查前的状态开始 调用会写回全部栈槽
+            // 汇合后两条路径的表示相同 写回状态以快路径为准
+            emitLabel(jit, slow);
+            restoreSlots(jit, &before);
+            emitCheckedCall(jit, pc, HELPER_ADD, jit->depth - 1,
+                            jit->depth - 2, 0);
+            restoreSlots(jit, &after);
+            emitLabel(jit, done);
+            break;
+        }
+        case OP_SUBTRACT:
+            emitBinaryOp(jit, pc, MIR_DSUB, false);
+            break;
+        case OP_MULTIPLY:
+            emitBinaryOp(jit, pc, MIR_DMUL, false);
+            break;
+        case OP_DIVIDE:
+            emitBinaryOp(jit, pc, MIR_DDIV, false);
+            break;
+        case OP_NOT: {
+            int index = stackIndex(jit, 0);
+            if (jit->kinds[index] == SLOT_NUMBER) {
+                // 数字总是真值
+                setValue(jit, index, MIR_new_uint_op(jit->ctx, FALSE_VAL));
+                break;
+            }
+            MIR_reg_t result = emitFalsey(jit, REG(jit->values[index]));
+            INSN(MIR_ADD, REG(result), REG(result), IMM(FALSE_VAL));
+            setValue(jit, index, REG(result));
+            break;
+        }
+        case OP_NEGATE: {
+            MIR_label_t fail = MIR_new_label(jit->ctx);
+            MIR_label_t done = MIR_new_label(jit->ctx);
+            MIR_reg_t value = newReg(jit, MIR_T_D);
+            SlotState state;
+            saveSlots(jit, &state);
+            emitNumberCheck(jit, 0, fail);
+            INSN(MIR_DNEG, REG(value), stackNumber(jit, 0));
+            setNumber(jit, stackIndex(jit, 0), REG(value));
+            INSN(MIR_JMP, LABEL(done));
+            emitLabel(jit, fail);
+            emitCheckFailure(jit, pc, &state, JIT_ERROR_NUMBER);
+            emitLabel(jit, done);
+            break;
+        }
+        case OP_PRINT: {
+            MIR_op_t value = stackValue(jit, 0);
+            emitDrop(jit, 1);
+            beginCall(jit, pc);
+            emitCall(jit, HELPER_PRINT, 0, 1, value);
+            break;
+        }
+        case OP_JUMP:
+            emitJump(jit, pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]));
+            fallsThrough = false;
+            break;
+        case OP_JUMP_IF_FALSE: {
+            int target = pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]);
+            // 数字总是真值 不会跳转
+            if (jit->kinds[stackIndex(jit, 0)] == SLOT_NUMBER) {
+                break;
+            }
+            reconcileKinds(jit, target);
+            MIR_reg_t falsey = emitFalsey(jit, stackValue(jit, 0));
+            INSN(MIR_BT, LABEL(jit->labels[target]), REG(falsey));
+            break;
+        }
+        case OP_LOOP:
+            emitJump(jit, pc + 3 - ((code[pc + 1] << 8) | code[pc + 2]));
+            fallsThrough = false;
+            break;
+        case OP_CALL: {
+            int argCount = code[pc + 1];
+            MIR_op_t callee = stackValue(jit, argCount);
+            emitCheckedCall(jit, pc, HELPER_CALL_VALUE, jit->depth - argCount,
+                            jit->depth - argCount - 1, 2, callee,
+                            IMM(argCount));
+            break;
+        }
+        case OP_INVOKE: {
+            int argCount = code[pc + 2];
+            emitCheckedCall(jit, pc, HELPER_INVOKE, jit->depth - argCount,
+                            jit->depth - argCount - 1, 3,
+                            emitObjConstant(jit, code[pc + 1]), IMM(argCount),
+                            emitInlineCache(jit, pc + 3));
+            break;
+        }
+        case OP_SUPER_INVOKE: {
+            int argCount = code[pc + 2];
+            emitCheckedCall(jit, pc, HELPER_SUPER_INVOKE,
+                            jit->depth - argCount - 1, jit->depth - argCount - 2,
+                            2, emitObjConstant(jit, code[pc + 1]),
+                            IMM(argCount));
+            break;
+        }
+        case OP_CLOSURE: {
+            MIR_op_t function = emitObjConstant(jit, code[pc + 1]);
+            MIR_reg_t upvalues = newReg(jit, MIR_T_I64);
+            INSN(MIR_ADD, REG(upvalues), REG(jit->code), IMM(pc + 2));
+            beginCall(jit, pc);
+            emitCall(jit, HELPER_CLOSURE, 0, 3, REG(jit->frame), function,
+                     REG(upvalues));
+            reloadSlot(jit, jit->depth++);
+            break;
+        }
+        case OP_CLOSE_UPVALUE: {
+            MIR_reg_t last = newReg(jit, MIR_T_I64);
+            beginCall(jit, pc);
+            INSN(MIR_ADD, REG(last), REG(jit->slots),
+                 IMM((jit->depth - 1) * sizeof(Value)));
+            emitCall(jit, HELPER_CLOSE_UPVALUES, 0, 1, REG(last));
+            emitDrop(jit, 1);
+            break;
+        }
+        case OP_RETURN:
+            emitReturn(jit, pc);
+            fallsThrough = false;
+            break;
+        case OP_CLASS: {
+            MIR_op_t name = emitObjConstant(jit, code[pc + 1]);
+            MIR_reg_t klass = newReg(jit, MIR_T_I64);
+            beginCall(jit, pc);
+            emitCall(jit, HELPER_NEW_CLASS, klass, 1, name);
+            INSN(MIR_OR, REG(klass), REG(klass), IMM(SIGN_BIT | QNAN));
+            pushValue(jit, REG(klass));
+            break;
+        }
+        case OP_INHERIT:
+            emitCheckedCall(jit, pc, HELPER_INHERIT, jit->depth - 1, jit->depth,
+                            0);
+            break;
+        case OP_METHOD: {
+            MIR_op_t name = emitObjConstant(jit, code[pc + 1]);
+            beginCall(jit, pc);
+            emitCall(jit, HELPER_DEFINE_METHOD, 0, 1, name);
+            emitDrop(jit, 1);
+            break;
+        }
+        }
+    }
+}
 
-static LoxFunction LoxFunctions[] = {
-    {"runtimeError", runtimeError},
-    {"push", push},
-    {"pop", pop},
-    {"peek", peek},
-    {"callValue", callValue},
-    {"invokeFromClass", invokeFromClass},
-    {"invoke", invoke},
-    {"tableGet", tableGet},
-    {"tableSet", tableSet},
-    {"newClosure", newClosure},
-    {"closeUpvalues", closeUpvalues},
-    {"printf", printf},
-    {"printValue", printValue},
-    {"isFalsey", isFalsey},
-    {"concatenate", concatenate},
-    {"numToValue", numToValue},
-    {"valueToNum", valueToNum},
-    {"isObjType", isObjType},
-    {"captureUpvalue", captureUpvalue},
-    {"newClass", newClass},
-    {"defineMethod", defineMethod},
-    {"bindMethod", bindMethod},
-    {"tableAddAll", tableAddAll},
-    {"tableDelete", tableDelete},
-    {NULL, NULL},
-};
+// 用MIR API直接把函数字节码生成为MIR函数并编译成机器码
+// osr为true时生成从循环头进入的版本
+// 在当前模块里生成一个函数
+// code和typeProfile为initUnit复制的副本
+static MIR_item_t compileFunction(JitCompiler *jit, ObjFunction *function,
+                                  uint8_t *code, uint8_t *typeProfile,
+                                  const char *name, bool osr) {
+    jit->function = function;
+    jit->chunk = function->chunk;
+    jit->chunk.code = code;
+    jit->typeProfile = typeProfile;
+    jit->regCount = 0;
+    jit->entryDepth = function->arity + 1;
 
-static void *import_resolver(const char *name) {
-    for (int i = 0; LoxFunctions[i].name; i++) {
-        if (!strcmp(name, LoxFunctions[i].name)) {
-            return LoxFunctions[i].func;
+    MIR_type_t resultType = MIR_T_I32;
+    jit->func = MIR_new_func(jit->ctx, name, 1, &resultType, 2, MIR_T_P, "vm",
+                             MIR_T_P, "closure");
+    jit->vm = MIR_reg(jit->ctx, "vm", jit->func->u.func);
+    jit->closure = MIR_reg(jit->ctx, "closure", jit->func->u.func);
+    jit->frame = newReg(jit, MIR_T_I64);
+    jit->slots = newReg(jit, MIR_T_I64);
+    jit->consts = newReg(jit, MIR_T_I64);
+    jit->caches = newReg(jit, MIR_T_I64);
+    jit->code = newReg(jit, MIR_T_I64);
+    jit->scratch = newReg(jit, MIR_T_I64);
+    jit->errorLabel = MIR_new_label(jit->ctx);
+
+    int codeCount = function->chunk.count;
+    jit->labels = calloc(codeCount + 1, sizeof(MIR_label_t));
+    jit->depths = malloc(sizeof(int) * (codeCount + 1));
+    collectLabels(jit);
+    analyzeDepths(jit);
+
+    int slotCount = jit->maxDepth + 1;
+    jit->captured = calloc(slotCount, sizeof(bool));
+    jit->written = calloc(slotCount, sizeof(bool));
+    jit->entryKinds = malloc((codeCount + 1) * slotCount);
+    analyzeSlots(jit);
+    analyzeKinds(jit);
+
+    jit->values = malloc(sizeof(MIR_reg_t) * slotCount);
+    jit->numbers = malloc(sizeof(MIR_reg_t) * slotCount);
+    jit->kinds = calloc(slotCount, sizeof(uint8_t));
+    jit->dirty = calloc(slotCount, sizeof(bool));
+    for (int i = 0; i < slotCount; i++) {
+        char slotName[16];
+        snprintf(slotName, sizeof(slotName), "s%d", i);
+        jit->values[i] =
+            MIR_new_func_reg(jit->ctx, jit->func->u.func, MIR_T_I64, slotName);
+        snprintf(slotName, sizeof(slotName), "d%d", i);
+        jit->numbers[i] =
+            MIR_new_func_reg(jit->ctx, jit->func->u.func, MIR_T_D, slotName);
+    }
+
+    if (osr) {
+        emitOsrPrologue(jit);
+    } else {
+        emitPrologue(jit);
+    }
+    translate(jit);
+
+    emitLabel(jit, jit->errorLabel);
+    MIR_append_insn(jit->ctx, jit->func,
+                    MIR_new_ret_insn(jit->ctx, 1, IMM(INTERPRET_RUNTIME_ERROR)));
+
+    MIR_finish_func(jit->ctx);
+    free(jit->labels);
+    free(jit->depths);
+    free(jit->captured);
+    free(jit->written);
+    free(jit->entryKinds);
+    free(jit->values);
+    free(jit->numbers);
+    free(jit->kinds);
+    free(jit->dirty);
+    return jit->func;
+}
+
+// 编译单元 触发编译的函数加上它常量池里(递归)已经执行过但还没编译的函数
+typedef struct {
+    ObjFunction **functions; // 首个为触发编译的函数
+    uint8_t **codes;         // 各函数还原为原指令的字节码副本
+    uint8_t **profiles;      // 各函数类型记录的副本
+    int count;
+    int capacity;
+} JitUnit;
+
+static void addUnitFunction(JitUnit *unit, ObjFunction *function) {
+    if (unit->count == unit->capacity) {
+        unit->capacity = unit->capacity < 8 ? 8 : unit->capacity * 2;
+        unit->functions = realloc(unit->functions,
+                                  sizeof(ObjFunction *) * unit->capacity);
+        unit->codes = realloc(unit->codes, sizeof(uint8_t *) * unit->capacity);
+        unit->profiles =
+            realloc(unit->profiles, sizeof(uint8_t *) * unit->capacity);
+    }
+    int count = function->chunk.count;
+    unit->codes[unit->count] = baseCode(&function->chunk);
+    unit->profiles[unit->count] = malloc(count);
+    memcpy(unit->profiles[unit->count], function->typeProfile, count);
+    unit->functions[unit->count++] = function;
+}
+
+// 从未执行过的函数没有类型记录 留给解释器按调用次数分层
+static void collectUnit(JitUnit *unit, ObjFunction *function) {
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (!IS_FUNCTION(constants->values[i])) continue;
+        ObjFunction *nested = AS_FUNCTION(constants->values[i]);
+        if (nested->callCount > 0 && nested->jitFunction == NULL) {
+            addUnitFunction(unit, nested);
         }
+        collectUnit(unit, nested);
     }
-    return NULL;
 }
 
+// 收集编译单元 读取调用次数和机器码 只在解释器线程调用
+// 解释器会继续改写字节码和类型记录 这里复制一份 后台编译只读副本
+static void initUnit(JitUnit *unit, ObjFunction *function) {
+    unit->functions = NULL;
+    unit->codes = NULL;
+    unit->profiles = NULL;
+    unit->count = 0;
+    unit->capacity = 0;
+    addUnitFunction(unit, function);
+    collectUnit(unit, function);
+}
+
+static void freeUnit(JitUnit *unit) {
+    for (int i = 0; i < unit->count; i++) {
+        free(unit->codes[i]);
+        free(unit->profiles[i]);
+    }
+    free(unit->functions);
+    free(unit->codes);
+    free(unit->profiles);
+    unit->functions = NULL;
+    unit->codes = NULL;
+    unit->profiles = NULL;
+    unit->count = unit->capacity = 0;
+}
+
+// 缓存格式版本 改变生成的代码或VM结构布局时增加
+#define JIT_CACHE_VERSION 5
+
+// FNV-1a 64位
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+#define HASH_FIELD(hash, value) hashBytes(hash, &(value), sizeof(value))
+
+// 缓存键 覆盖生成代码依赖的全部输入
+// 字节码、类型记录、常量的类型和数值、内层函数的参数和提升值数以及VM布局
+static uint64_t jitCacheKey(JitUnit *unit, bool osr) {
+    uint64_t hash = 14695981039346656037u;
+    int version = JIT_CACHE_VERSION;
+    size_t layout[] = {sizeof(VM),         sizeof(CallFrame),
+                       sizeof(ObjFunction), sizeof(ObjClosure),
+                       sizeof(ObjUpvalue),  sizeof(ObjInstance),
+                       offsetof(VM, frameCount), offsetof(VM, stackTop),
+                       offsetof(VM, globalValues), offsetof(VM, globalNames),
+                       offsetof(ObjInstance, shape),
+                       offsetof(ObjInstance, fields)};
+    hash = HASH_FIELD(hash, version);
+    hash = HASH_FIELD(hash, layout);
+    hash = HASH_FIELD(hash, osr);
+
+    for (int i = 0; i < unit->count; i++) {
+        ObjFunction *function = unit->functions[i];
+        Chunk *chunk = &function->chunk;
+        hash = HASH_FIELD(hash, function->arity);
+        hash = HASH_FIELD(hash, chunk->count);
+        hash = hashBytes(hash, unit->codes[i], chunk->count);
+        hash = hashBytes(hash, unit->profiles[i], chunk->count);
+        hash = HASH_FIELD(hash, chunk->constants.count);
+        for (int j = 0; j < chunk->constants.count; j++) {
+            Value value = chunk->constants.values[j];
+            if (IS_OBJ(value)) {
+                ObjType type = OBJ_TYPE(value);
+                hash = HASH_FIELD(hash, type);
+                if (type == OBJ_FUNCTION) {
+                    hash = HASH_FIELD(hash, AS_FUNCTION(value)->arity);
+                    hash = HASH_FIELD(hash, AS_FUNCTION(value)->upvalueCount);
+                }
+            } else {
+                hash = HASH_FIELD(hash, value);
+            }
+        }
+    }
+    return hash;
+}
+
+#undef HASH_FIELD
+
+static void jitCachePath(VM *vm, uint64_t key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.mirb", vm->jitCacheDir,
+             (unsigned long long)key);
+}
+
+// 从缓存读取模块 没有缓存返回NULL
+static MIR_module_t jitCacheRead(VM *vm, uint64_t key) {
+    char path[1024];
+    jitCachePath(vm, key, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    MIR_read(vm->mirContext, file);
+    fclose(file);
+    return DLIST_TAIL(MIR_module_t, *MIR_get_module_list(vm->mirContext));
+}
+
+// 写入缓存 先写临时文件再改名 多个解释器同时运行时不会读到写了一半的文件
+static void jitCacheWrite(VM *vm, uint64_t key, MIR_module_t module) {
+    char path[1024];
+    char temp[1100];
+    jitCachePath(vm, key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) return;
+    MIR_write_module(vm->mirContext, file, module);
+    if (fclose(file) != 0 || rename(temp, path) != 0) {
+        remove(temp);
+    }
+}
+
+// 取出模块里的函数 按定义顺序 数量不符返回false
+static bool moduleFunctions(MIR_module_t module, MIR_item_t *items,
+                            int count) {
+    int found = 0;
+    for (MIR_item_t item = DLIST_HEAD(MIR_item_t, module->items); item != NULL;
+         item = DLIST_NEXT(MIR_item_t, item)) {
+        if (item->item_type != MIR_func_item) continue;
+        if (found == count) return false;
+        items[found++] = item;
+    }
+    return found == count;
+}
+
+// 把编译单元放进一个模块 模块和链接的开销由单元内的函数分摊
+// 首个函数马上就要执行 直接生成 其余函数在第一次被调用时才生成
+// 后台编译时单元内的函数都在后台线程生成 解释器线程不再用到代码生成器
+// codes按单元顺序返回各函数入口 OSR时首个为OSR版本
+static void compileMIR(VM *vm, JitUnit *unit, const char *name, bool osr,
+                       JitFunction *codes) {
+    JitCompiler compiler;
+    JitCompiler *jit = &compiler;
+    jit->ctx = vm->mirContext;
+
+    MIR_item_t *items = malloc(sizeof(MIR_item_t) * unit->count);
+
+    // 命中缓存时跳过模块构建
+    uint64_t key = 0;
+    MIR_module_t module = NULL;
+    if (vm->jitCacheDir != NULL) {
+        key = jitCacheKey(unit, osr);
+        module = jitCacheRead(vm, key);
+        if (module != NULL && !moduleFunctions(module, items, unit->count)) {
+            module = NULL;
+        }
+    }
+
+    if (module == NULL) {
+        module = MIR_new_module(jit->ctx, name);
+        declareHelpers(jit);
+        for (int i = 0; i < unit->count; i++) {
+            char funcName[48];
+            snprintf(funcName, sizeof(funcName), "%s_%d", name, i);
+            items[i] = compileFunction(jit, unit->functions[i],
+                                       unit->codes[i], unit->profiles[i],
+                                       funcName, osr && i == 0);
+        }
+        MIR_finish_module(jit->ctx);
+        if (vm->jitCacheDir != NULL) {
+            jitCacheWrite(vm, key, module);
+        }
+    }
+
+#ifdef DEBUG_DUMP_JIT
+    FILE *f = fopen(name, "w+");
+    MIR_output_module(jit->ctx, f, module);
+    fclose(f);
+#endif
+
+    MIR_load_module(jit->ctx, module);
+    MIR_link(jit->ctx,
+             vm->jitQueue != NULL ? MIR_set_gen_interface
+                                  : MIR_set_lazy_gen_interface,
+             import_resolver);
+    codes[0] = (JitFunction)MIR_gen(jit->ctx, 0, items[0]);
+    for (int i = 1; i < unit->count; i++) {
+        codes[i] = (JitFunction)items[i]->addr;
+    }
+    free(items);
+}
+
+// 在解释器线程编译函数所在的编译单元 返回触发编译的函数的入口
+static JitFunction compileUnit(VM *vm, ObjFunction *function, const char *name,
+                               bool osr) {
+    JitUnit unit;
+    initUnit(&unit, function);
+    JitFunction *codes = calloc(unit.count, sizeof(JitFunction));
+    compileMIR(vm, &unit, name, osr, codes);
+    for (int i = 1; i < unit.count; i++) {
+        unit.functions[i]->jitFunction = codes[i];
+    }
+    JitFunction code = codes[0];
+    free(codes);
+    freeUnit(&unit);
+    return code;
+}
+
+#undef INSN
+#undef REG
+#undef IMM
+#undef MEM
+#undef LABEL
+#undef VALUE_MEM
+#undef SLOT_MEM
+#undef KINDS_AT
+
+#ifdef JIT_C_BACKEND
+
+static const char LOX_HEADER[];
+
 typedef struct JitBuffer {
     char *buffer;
     size_t p;
@@ -128,6 +1818,7 @@ static int jit_getc(void *data) {
         CODE("  double a,b;");                                                 \
         CODE("  ObjInstance *instance;");                                      \
         CODE("  ObjClosure *closure;");                                        \
+        CODE("  ObjClass *superclass;");                                       \
     } while (0)
 
 #define CLOSE_FUNC                                                             \
@@ -137,21 +1828,20 @@ static int jit_getc(void *data) {
     } while (0)
 
 static void setJmps(ObjClosure *closure, uint8_t *isJmps) {
-    uint8_t *code = closure->function->chunk.code;
-    for (int pc = 0; pc < closure->function->chunk.count; pc++) {
+    Chunk *chunk = &closure->function->chunk;
+    uint8_t *code = chunk->code;
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
         uint8_t instruction = code[pc];
         switch (instruction) {
         case OP_JUMP:
         case OP_JUMP_IF_FALSE: {
             uint16_t offset = (uint16_t)((code[pc + 1] << 8) | code[pc + 2]);
-            pc += 2;
-            isJmps[pc + offset + 1] = 1;
+            isJmps[pc + 3 + offset] = 1;
             break;
         }
         case OP_LOOP: {
             uint16_t offset = (uint16_t)((code[pc + 1] << 8) | code[pc + 2]);
-            pc += 2;
-            isJmps[pc - offset + 1] = 1;
+            isJmps[pc + 3 - offset] = 1;
             break;
         }
         default:
@@ -164,8 +1854,7 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
                          char *name, int argCount) {
     strTobuffer(buff, LOX_HEADER);
     int codeCount = closure->function->chunk.count;
-    uint8_t *isJmps = malloc(codeCount * sizeof(uint8_t));
-    memset(isJmps, 0, codeCount * sizeof(uint8_t));
+    uint8_t *isJmps = calloc(codeCount + 1, sizeof(uint8_t));
     OPEN_FUNC(name);
 
     setJmps(closure, isJmps);
@@ -182,6 +1871,7 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
 #define READ_CONSTANT()                                                        \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->inlineCaches[READ_SHORT()])
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
         CODE("  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {");           \
@@ -193,14 +1883,16 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
         CODE("  push(%s(a %s b)); ", valueType, op);                           \
     } while (false)
 
-    int pc = 0;
-    while (pc < codeCount) {
-        pc = frame->ip - closure->function->chunk.code;
-        uint8_t instruction = READ_BYTE();
+    uint8_t *codeEnd = closure->function->chunk.code + codeCount;
+    while (frame->ip < codeEnd) {
+        int pc = frame->ip - closure->function->chunk.code;
+        uint8_t instruction = baseOpcode(READ_BYTE());
 
-        if (pc < codeCount && isJmps[pc]) {
+        if (isJmps[pc]) {
             CODE("Label_%d:", pc);
         }
+        // 报错时按frame->ip计算行号
+        CODE("  frame->ip = _closure->function->chunk.code + %d;", pc + 1);
 
         switch (instruction) {
         case OP_CONSTANT: {
@@ -234,32 +1926,32 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
             break;
         }
         case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            CODE("  name = (ObjString *)%p;", name);
-            CODE("  if (!tableGet(&vm->globals, name, &value)) {");
+            uint16_t slot = READ_SHORT();
+            CODE("  value = vm->globalValues.values[%u];", slot);
+            CODE("  if (value == UNDEFINED_VAL) {");
             CODE("      runtimeError(\"Undefined variable '%%s'.\", "
-                 "name->chars);");
+                 "((ObjString *)%p)->chars);",
+                 AS_STRING(vm->globalNames.values[slot]));
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
             CODE("  push(value);");
             break;
         }
         case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            CODE("  name = (ObjString *)%p;", name);
-            CODE("  tableSet(&vm->globals, name, peek(0));");
+            uint16_t slot = READ_SHORT();
+            CODE("  vm->globalValues.values[%u] = peek(0);", slot);
             CODE("  pop();");
             break;
         }
         case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            CODE("  if (tableSet(&vm->globals, name, peek(0))) {");
-            CODE("      name = (ObjString *)%p;", name);
-            CODE("      tableDelete(&vm->globals, name);");
+            uint16_t slot = READ_SHORT();
+            CODE("  if (vm->globalValues.values[%u] == UNDEFINED_VAL) {", slot);
             CODE("      runtimeError(\"Undefined variable '%%s'.\", "
-                 "name->chars);");
+                 "((ObjString *)%p)->chars);",
+                 AS_STRING(vm->globalNames.values[slot]));
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
+            CODE("  vm->globalValues.values[%u] = peek(0);", slot);
             break;
         }
         case OP_GET_UPVALUE: {
@@ -272,47 +1964,31 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
             Value value = READ_BYTE();
             CODE("  slot = %u;", (uint8_t)value);
             CODE("  *frame->closure->upvalues[slot]->location = peek(0);");
+            CODE("  rememberObject((Obj *)frame->closure->upvalues[slot]);");
             break;
         }
         case OP_GET_PROPERTY: {
-            CODE("  if (!IS_INSTANCE(peek(0))) {");
-            CODE("      runtimeError(\"Only instances have properties.\");");
-            CODE("      return INTERPRET_RUNTIME_ERROR;");
-            CODE("  }");
-
-            CODE("  instance = AS_INSTANCE(peek(0));");
             ObjString *name = READ_STRING();
-            CODE("  name = (ObjString *)%p;", name);
-
-            CODE("  if (tableGet(&instance->fields, name, &value)) {");
-            CODE("      pop();");
-            CODE("      push(value);");
-            CODE("  } else {");
-            CODE("      if (!bindMethod(instance->klass, name)) {");
-            CODE("          return INTERPRET_RUNTIME_ERROR;");
-            CODE("      }");
+            InlineCache *cache = READ_CACHE();
+            CODE("  if (!getProperty((ObjString *)%p, (void *)%p)) {", name,
+                 cache);
+            CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
             break;
         }
         case OP_SET_PROPERTY: {
-            CODE("  if (!IS_INSTANCE(peek(1))) {");
-            CODE("      runtimeError(\"Only instances have fields.\");");
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            CODE("  if (!setProperty((ObjString *)%p, (void *)%p)) {", name,
+                 cache);
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
-
-            CODE("  instance = AS_INSTANCE(peek(1));");
-            ObjString *name = READ_STRING();
-            CODE("  tableSet(&instance->fields, (ObjString *)%p, peek(0));",
-                 name);
-            CODE("  value = pop();");
-            CODE("  pop();");
-            CODE("  push(value);");
             break;
         }
         case OP_GET_SUPER: {
             ObjString *name = READ_STRING();
             CODE("  name = (ObjString *)%p;", name);
-            CODE("  ObjClass *superclass = AS_CLASS(pop());");
+            CODE("  superclass = AS_CLASS(pop());");
 
             CODE("  if (!bindMethod(superclass, name)) {");
             CODE("      return INTERPRET_RUNTIME_ERROR;");
@@ -320,9 +1996,11 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
             break;
         }
         case OP_EQUAL: {
-            CODE("  Value b = pop();");
-            CODE("  Value a = pop();");
-            CODE("  push(BOOL_VAL(valuesEqual(a, b)));");
+            CODE("  {");
+            CODE("      Value b = pop();");
+            CODE("      Value a = pop();");
+            CODE("      push(BOOL_VAL(valuesEqual(a, b)));");
+            CODE("  }");
             break;
         }
         case OP_GREATER:
@@ -332,11 +2010,11 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
             BINARY_OP("BOOL_VAL", "<");
             break;
         case OP_ADD: {
-            CODE("  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {");
+            CODE("  if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {");
             CODE("      concatenate();");
             CODE("  } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {");
-            CODE("      double b = AS_NUMBER(pop());");
-            CODE("      double a = AS_NUMBER(pop());");
+            CODE("      b = AS_NUMBER(pop());");
+            CODE("      a = AS_NUMBER(pop());");
             CODE("      push(NUMBER_VAL(a + b));");
             CODE("  } else {");
             CODE("      runtimeError(\"Operands must be two numbers or two "
@@ -387,7 +2065,7 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
         }
         case OP_CALL: {
             int argCount = READ_BYTE();
-            CODE("  if (!callValue(peek(%d), %d)) {", argCount, argCount);
+            CODE("  if (!jitCallValue(peek(%d), %d)) {", argCount, argCount);
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
             CODE("  frame = &vm->frames[vm->frameCount - 1];");
@@ -396,7 +2074,9 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
         case OP_INVOKE: {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            CODE("  if (!invoke(%p, %d)) {", method, argCount);
+            InlineCache *cache = READ_CACHE();
+            CODE("  if (!jitInvoke((ObjString *)%p, %d, (void *)%p)) {", method,
+                 argCount, cache);
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
             CODE("  frame = &vm->frames[vm->frameCount - 1];");
@@ -405,9 +2085,7 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
         case OP_SUPER_INVOKE: {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            CODE("  ObjClass *superclass = AS_CLASS(pop());");
-            CODE("  if (!invokeFromClass(superclass, (ObjString*)%p, %d)) {", method,
-                 argCount);
+            CODE("  if (!jitSuperInvoke((ObjString*)%p, %d)) {", method, argCount);
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
             CODE("  frame = &vm->frames[vm->frameCount - 1];");
@@ -433,6 +2111,9 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
                          i, index);
                 }
             }
+            if (function->upvalueCount > 0) {
+                CODE("  rememberObject((Obj *)closure);");
+            }
             break;
         }
         case OP_CLOSE_UPVALUE:
@@ -460,15 +2141,14 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
             break;
         }
         case OP_INHERIT: {
-            CODE("  Value superclass = peek(1);");
-            CODE("  if (!IS_CLASS(superclass)) {");
+            CODE("  if (!IS_CLASS(peek(1))) {");
             CODE("      runtimeError(\"Superclass must be a class.\");");
             CODE("      return INTERPRET_RUNTIME_ERROR;");
             CODE("  }");
 
-            CODE("  ObjClass *subclass = AS_CLASS(peek(0));");
-            CODE("  tableAddAll(&AS_CLASS(superclass)->methods, "
-                 "&subclass->methods);");
+            CODE("  tableAddAll(&AS_CLASS(peek(1))->methods, "
+                 "&AS_CLASS(peek(0))->methods);");
+            CODE("  rememberObject(AS_OBJ(peek(0)));");
             CODE("  pop();");
             break;
         }
@@ -484,66 +2164,55 @@ static void codeGenerate(VM *vm, JitBuffer *buff, ObjClosure *closure,
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
 
     CLOSE_FUNC;
 
     free(isJmps);
-#ifdef DEBUG_PRINT_CODE
+#ifdef DEBUG_DUMP_JIT
     FILE *f = fopen(name, "w+");
     fprintf(f, "%s\n", buff->buffer);
     fclose(f);
 #endif
 }
 
-void jitCompile(VM *vm, ObjClosure *closure, int argCount) {
+
+// 生成C代码再交给c2mir编译 仅用于调试对照
+static JitFunction compileC(VM *vm, ObjFunction *function, char *name,
+                            int argCount) {
     MIR_context_t ctx = vm->mirContext;
-    c2mir_init(ctx);
-    MIR_gen_init(ctx, 2);
+    JitFunction fp = NULL;
     JitBuffer buff;
     initBuffer(&buff, strlen(LOX_HEADER) + 4096);
 
-    char name[32];
-
-    snprintf(name, sizeof(name), "jit_func_%ld", ++vm->mirOptions.module_num);
-    codeGenerate(vm, &buff, closure, name, argCount);
+    ObjClosure closure;
+    closure.function = function;
+    codeGenerate(vm, &buff, &closure, name, argCount);
 
+    c2mir_init(ctx);
     if (!c2mir_compile(ctx, &vm->mirOptions, jit_getc, &buff, name, NULL)) {
-        runtimeError("jit compiler error!");
         goto CLEANUP;
     }
-    /* c2mir_compile will clear the name */
-    snprintf(name, sizeof(name), "jit_func_%ld", vm->mirOptions.module_num);
 
     MIR_module_t module = DLIST_TAIL(MIR_module_t, *MIR_get_module_list(ctx));
     MIR_load_module(ctx, module);
     MIR_link(ctx, MIR_set_gen_interface, import_resolver);
-    MIR_item_t func = DLIST_HEAD(MIR_item_t, module->items);
-    while (func) {
+    for (MIR_item_t func = DLIST_HEAD(MIR_item_t, module->items); func != NULL;
+         func = DLIST_NEXT(MIR_item_t, func)) {
         if (func->item_type == MIR_func_item &&
             !strcmp(name, func->u.func->name)) {
+            fp = (JitFunction)func->u.func->machine_code;
             break;
         }
-        func = DLIST_NEXT(MIR_item_t, func);
-    }
-    if (func == NULL) {
-        runtimeError("jit compiler error!");
-        goto CLEANUP;
-    }
-    int (*fp)(void *, ObjClosure *) = MIR_gen(ctx, 0, func);
-    if (fp) {
-        closure->jitFunction = fp;
-    } else {
-        closure->jitFunction = NULL;
-        runtimeError("jit gen error!");
-        goto CLEANUP;
     }
 CLEANUP:
-    MIR_gen_finish(ctx);
     c2mir_finish(ctx);
     FREE_BUFFER(buff);
+    return fp;
 }
 
+
 static const char LOX_HEADER[] = {
     "#ifdef __MIRC__\n"
     "#endif\n"
@@ -552,6 +2221,7 @@ static const char LOX_HEADER[] = {
     "#define TAG_NIL 1\n"
     "#define TAG_FALSE 2\n"
     "#define TAG_TRUE  3\n"
+    "#define TAG_UNDEFINED 4\n"
     "typedef char bool;\n"
     "typedef unsigned long int uint64_t;\n"
     "typedef unsigned long int uintptr_t;\n"
@@ -564,6 +2234,7 @@ static const char LOX_HEADER[] = {
     "#define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | "
     "(uint64_t)(uintptr_t)(obj))\n"
     "#define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))\n"
+    "#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))\n"
     "#define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)\n"
     "#define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))\n"
     "#define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))\n"
@@ -576,6 +2247,8 @@ static const char LOX_HEADER[] = {
     "#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)\n"
     "#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)\n"
     "#define IS_STRING(value) isObjType(value, OBJ_STRING)\n"
+    "#define IS_ANY_STRING(value) (IS_STRING(value) || "
+    "isObjType(value, OBJ_CONCAT))\n"
     "#define IS_CLASS(value) isObjType(value, OBJ_CLASS)\n"
     "#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | "
     "SIGN_BIT))\n"
@@ -591,6 +2264,9 @@ static const char LOX_HEADER[] = {
     "   OBJ_NATIVE,\n"
     "   OBJ_STRING,\n"
     "   OBJ_UPVALUE,\n"
+    "   OBJ_SHAPE,\n"
+    "   OBJ_CONCAT,\n"
+    "   OBJ_BUFFER,\n"
     "} ObjType;\n"
     "\n"
     "typedef enum {\n"
@@ -602,6 +2278,7 @@ static const char LOX_HEADER[] = {
     "typedef struct Obj {\n"
     "   ObjType type;\n"
     "   bool isMarked;\n"
+    "   bool isRemembered;\n"
     "   struct Obj *next;\n"
     "} Obj;\n"
     "\n"
@@ -622,8 +2299,8 @@ static const char LOX_HEADER[] = {
     "typedef struct {\n"
     "   Obj obj;\n"
     "   int length;\n"
-    "   char *chars;\n"
     "   uint32_t hash;\n"
+    "   char chars[];\n"
     "} ObjString;\n"
     "\n"
     "typedef struct {\n"
@@ -642,7 +2319,9 @@ static const char LOX_HEADER[] = {
     "\n"
     "typedef struct {\n"
     "   int count;\n"
+    "   int tombstones;\n"
     "   int capacity;\n"
+    "   uint8_t *control;\n"
     "   Entry *entries;\n"
     "} Table;\n"
     "typedef struct {\n"
@@ -651,10 +2330,21 @@ static const char LOX_HEADER[] = {
     "    Table methods;\n"
     "} ObjClass;\n"
     "\n"
+    "typedef struct ObjShape {\n"
+    "    Obj obj;\n"
+    "    struct ObjShape *parent;\n"
+    "    ObjString *name;\n"
+    "    int fieldCount;\n"
+    "    Table transitions;\n"
+    "} ObjShape;\n"
+    "\n"
     "typedef struct {\n"
     "    Obj obj;\n"
     "    ObjClass *klass;\n"
-    "    Table fields;\n"
+    "    ObjShape *shape;\n"
+    "    Value *fields;\n"
+    "    int capacity;\n"
+    "    Value inlineFields[4];\n"
     "} ObjInstance;\n"
     "\n"
     "typedef struct ObjUpvalue {\n"
@@ -669,8 +2359,6 @@ static const char LOX_HEADER[] = {
     "   ObjFunction *function;\n"
     "   ObjUpvalue **upvalues;\n"
     "   int upvalueCount;\n"
-    "   int(*jitFunction)(void*);\n"
-    "   int execCount;\n"
     "} ObjClosure;\n"
     "\n"
     "typedef struct {\n"
@@ -684,7 +2372,9 @@ static const char LOX_HEADER[] = {
     "   int frameCount;\n"
     "   Value stack[STACK_MAX];\n"
     "   Value* stackTop;\n"
-    "   Table globals;\n"
+    "   ValueArray globalValues;\n"
+    "   ValueArray globalNames;\n"
+    "   Table globalSlots;\n"
     "   Table strings;\n"
     "   ObjString* initString;\n"
     "   ObjUpvalue* openUpvalues;\n"
@@ -703,10 +2393,16 @@ static const char LOX_HEADER[] = {
     "bool tableGet(Table *, ObjString *, Value *);\n"
     "bool tableSet(Table *, ObjString *, Value);\n"
     "void closeUpvalues(Value *);\n"
+    "void rememberObject(Obj *);\n"
     "ObjClosure *newClosure(ObjFunction *);\n"
     "ObjClass *newClass(ObjString *name);\n"
-    "bool callValue(Value, int);\n"
+    "bool jitCallValue(Value, int);\n"
+    "bool jitInvoke(ObjString *name, int argCount, void *cache);\n"
+    "bool getProperty(ObjString *name, void *cache);\n"
+    "bool setProperty(ObjString *name, void *cache);\n"
+    "bool jitSuperInvoke(ObjString *name, int argCount);\n"
     "bool isFalsey(Value);\n"
+    "bool valuesEqual(Value a, Value b);\n"
     "void concatenate();\n"
     "double valueToNum(Value);\n"
     "Value numToValue(double);\n"
@@ -716,7 +2412,272 @@ static const char LOX_HEADER[] = {
     "void defineMethod(ObjString *name);\n"
     "bool bindMethod(ObjClass *klass, ObjString *name);\n"
     "void tableAddAll(Table *from, Table *to);\n"
-    "bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount);\n"
     "bool tableDelete(Table *table, ObjString *key);\n"
     "int printf (const char *__restrict __fmt, ...);\n"
-    "\n"};
\ No newline at end of file
+    "\n"};
+
+#endif
+
+#ifndef JIT_C_BACKEND
+// 后台编译请求
+typedef struct JitRequest {
+    JitUnit unit;            // 待编译的函数 发布前作为GC根
+    bool osr;                // 首个函数是否编译OSR版本
+    void **thunks;           // 各函数入口 编译完成前转到解释器
+    JitFunction *codes;      // 编译结果 失败为NULL
+    bool done;               // 后台线程已处理完
+    struct JitRequest *next; // 下一个请求
+} JitRequest;
+
+// 后台编译队列 由唯一的后台线程按顺序编译
+// MIR上下文在建模块时不加锁 所以模块的构建、链接和生成都放在后台线程
+typedef struct JitQueue {
+    pthread_t thread;        // 后台编译线程
+    pthread_mutex_t mutex;   // 保护请求链表
+    pthread_cond_t signal;   // 有新请求或要求退出
+    JitRequest *head;        // 最早的未发布请求
+    JitRequest *tail;        // 最新的请求
+    JitRequest *pending;     // 下一个待编译的请求
+    atomic_bool finished;    // 有编译完但未发布的请求
+    bool stop;               // 要求后台线程退出
+} JitQueue;
+
+// 后台线程 取出请求编译 编译期间不持锁 解释器照常执行
+static void *jitWorker(void *arg) {
+    VM *vm = arg;
+    JitQueue *queue = vm->jitQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    for (;;) {
+        while (!queue->stop && queue->pending == NULL) {
+            pthread_cond_wait(&queue->signal, &queue->mutex);
+        }
+        if (queue->stop) break;
+
+        JitRequest *request = queue->pending;
+        pthread_mutex_unlock(&queue->mutex);
+
+        // 开启后台编译后只有这个线程使用MIR上下文和模块计数
+        char name[32];
+        snprintf(name, sizeof(name), "jit_func_%d", ++vm->jitModuleCount);
+        compileMIR(vm, &request->unit, name, request->osr, request->codes);
+
+        pthread_mutex_lock(&queue->mutex);
+        request->done = true;
+        queue->pending = request->next;
+        atomic_store_explicit(&queue->finished, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+static void freeRequest(JitRequest *request) {
+    freeUnit(&request->unit);
+    free(request->thunks);
+    free(request->codes);
+    free(request);
+}
+
+// 把编译完的机器码挂到thunk上 只在解释器线程调用
+// 失败的请求保持原样 函数继续解释执行
+static void jitPublish(VM *vm) {
+    JitQueue *queue = vm->jitQueue;
+    if (!atomic_load_explicit(&queue->finished, memory_order_acquire)) return;
+
+    pthread_mutex_lock(&queue->mutex);
+    atomic_store_explicit(&queue->finished, false, memory_order_relaxed);
+    while (queue->head != NULL && queue->head->done) {
+        JitRequest *request = queue->head;
+        for (int i = 0; i < request->unit.count; i++) {
+            if (request->codes[i] != NULL) {
+                _MIR_redirect_thunk(vm->mirContext, request->thunks[i],
+                                    request->codes[i]);
+            }
+        }
+        queue->head = request->next;
+        if (queue->tail == request) queue->tail = NULL;
+        freeRequest(request);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// 编译完成前的函数入口 压入解释器栈帧 由调用者解释执行
+static int jitPending(void *vmp, ObjClosure *closure) {
+    VM *vm = vmp;
+    jitPublish(vm);
+
+    CallFrame *frame = &vm->frames[vm->frameCount++];
+    frame->closure = closure;
+    frame->ip = entryCode(closure->function);
+    frame->slots = vm->stackTop - closure->function->arity - 1;
+    return INTERPRET_DEOPT;
+}
+
+// 编译完成前的OSR入口 解释器留在当前栈帧继续执行循环 经thunk调用 只用到vm
+static int jitOsrPending(void *vmp) {
+    jitPublish(vmp);
+    return INTERPRET_DEOPT;
+}
+
+// 启动后台编译线程
+static bool jitStartWorker(VM *vm) {
+    JitQueue *queue = malloc(sizeof(JitQueue));
+    if (queue == NULL) return false;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->signal, NULL);
+    queue->head = queue->tail = queue->pending = NULL;
+    atomic_init(&queue->finished, false);
+    queue->stop = false;
+
+    vm->jitQueue = queue;
+    if (pthread_create(&queue->thread, NULL, jitWorker, vm) != 0) {
+        pthread_cond_destroy(&queue->signal);
+        pthread_mutex_destroy(&queue->mutex);
+        free(queue);
+        vm->jitQueue = NULL;
+        return false;
+    }
+    return true;
+}
+
+// 停止后台线程 丢弃未发布的请求
+static void jitStopWorker(VM *vm) {
+    JitQueue *queue = vm->jitQueue;
+    pthread_mutex_lock(&queue->mutex);
+    queue->stop = true;
+    pthread_cond_signal(&queue->signal);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+
+    JitRequest *request = queue->head;
+    while (request != NULL) {
+        JitRequest *next = request->next;
+        freeRequest(request);
+        request = next;
+    }
+    pthread_cond_destroy(&queue->signal);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue);
+    vm->jitQueue = NULL;
+}
+
+// 把函数所在的编译单元放进后台编译队列 单元里的函数先转到解释器
+// 返回触发编译的函数的入口 失败返回NULL
+static JitFunction jitEnqueue(VM *vm, ObjFunction *function, bool osr) {
+    JitRequest *request = malloc(sizeof(JitRequest));
+    if (request == NULL) return NULL;
+    initUnit(&request->unit, function);
+    int count = request->unit.count;
+    request->osr = osr;
+    request->thunks = malloc(sizeof(void *) * count);
+    request->codes = calloc(count, sizeof(JitFunction));
+    request->done = false;
+    request->next = NULL;
+    for (int i = 0; i < count; i++) {
+        request->thunks[i] = _MIR_get_thunk(vm->mirContext);
+        _MIR_redirect_thunk(vm->mirContext, request->thunks[i],
+                            osr && i == 0 ? (void *)jitOsrPending
+                                          : (void *)jitPending);
+        if (i > 0) {
+            request->unit.functions[i]->jitFunction =
+                (JitFunction)request->thunks[i];
+        }
+    }
+
+    JitQueue *queue = vm->jitQueue;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail != NULL) {
+        queue->tail->next = request;
+    } else {
+        queue->head = request;
+    }
+    queue->tail = request;
+    if (queue->pending == NULL) queue->pending = request;
+    pthread_cond_signal(&queue->signal);
+    pthread_mutex_unlock(&queue->mutex);
+    return (JitFunction)request->thunks[0];
+}
+#endif
+
+void initJit(VM *vm) {
+    vm->mirContext = MIR_init();
+    vm->jitModuleCount = 0;
+    vm->jitQueue = NULL;
+    vm->jitBackground = true;
+    vm->jitCacheDir = NULL;
+    MIR_gen_init(vm->mirContext, 1);
+#ifdef JIT_C_BACKEND
+    memset(&vm->mirOptions, 0, sizeof(struct c2mir_options));
+    vm->mirOptions.message_file = stderr;
+    vm->mirOptions.module_num = 0;
+#endif
+}
+
+void freeJit(VM *vm) {
+#ifndef JIT_C_BACKEND
+    if (vm->jitQueue != NULL) jitStopWorker(vm);
+#endif
+    MIR_gen_finish(vm->mirContext);
+    MIR_finish(vm->mirContext);
+}
+
+void printJitStats(VM *vm) {
+    fprintf(stderr, "[jit] %d modules compiled\n", vm->jitModuleCount);
+}
+
+void jitCompile(VM *vm, ObjFunction *function) {
+#ifndef JIT_C_BACKEND
+    // 后台线程启动失败时退回到同步编译
+    if (vm->jitBackground && (vm->jitQueue != NULL || jitStartWorker(vm))) {
+        function->jitFunction = jitEnqueue(vm, function, false);
+        if (function->jitFunction == NULL) {
+            runtimeError("jit compiler error!");
+        }
+        return;
+    }
+#endif
+    char name[32];
+    snprintf(name, sizeof(name), "jit_func_%d", ++vm->jitModuleCount);
+
+#ifdef JIT_C_BACKEND
+    JitFunction fp = compileC(vm, function, name, function->arity);
+#else
+    JitFunction fp = compileUnit(vm, function, name, false);
+#endif
+    function->jitFunction = fp;
+    if (fp == NULL) {
+        runtimeError("jit compiler error!");
+    }
+}
+
+void jitCompileOsr(VM *vm, ObjFunction *function) {
+#ifndef JIT_C_BACKEND
+    if (vm->jitBackground && (vm->jitQueue != NULL || jitStartWorker(vm))) {
+        function->osrFunction = jitEnqueue(vm, function, true);
+        return;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "jit_func_%d", ++vm->jitModuleCount);
+    function->osrFunction = compileUnit(vm, function, name, true);
+#else
+    (void)vm;
+    (void)function;
+#endif
+}
+
+void markJitRoots(VM *vm) {
+#ifndef JIT_C_BACKEND
+    JitQueue *queue = vm->jitQueue;
+    if (queue == NULL) return;
+    pthread_mutex_lock(&queue->mutex);
+    for (JitRequest *request = queue->head; request != NULL;
+         request = request->next) {
+        for (int i = 0; i < request->unit.count; i++) {
+            markObject((Obj *)request->unit.functions[i]);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+#else
+    (void)vm;
+#endif
+}
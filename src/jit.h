@@ -7,6 +7,17 @@
 #include "vm.h"
 
 
-void jitCompile(VM *vm, ObjClosure *closure, int argCount);
+// 初始化JIT 创建MIR上下文和代码生成器
+void initJit(VM *vm);
+// 释放JIT
+void freeJit(VM *vm);
+// 编译函数 机器码挂在函数上 失败时function->jitFunction为NULL
+void jitCompile(VM *vm, ObjFunction *function);
+// 编译函数的OSR版本 从解释器当前栈帧的循环头进入 C后端不支持
+void jitCompileOsr(VM *vm, ObjFunction *function);
+// 标记后台编译队列里的函数 编译结果发布前不能被回收
+void markJitRoots(VM *vm);
+// 打印生成过的模块数 同一函数的闭包共用机器码 不会重复编译
+void printJitStats(VM *vm);
 
 #endif
\ No newline at end of file
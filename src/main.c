@@ -1,9 +1,22 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
+#ifdef OPEN_JIT
+#include "jit.h"
+#endif
+
+// --compile的输出路径 设置后只编译不执行
+static const char* compileOutput = NULL;
 
 
 // 命令模式 最长为1024
@@ -51,26 +64,155 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+// 路径是否以suffix结尾
+static bool hasSuffix(const char* path, const char* suffix) {
+    size_t length = strlen(path);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength &&
+           strcmp(path + length - suffixLength, suffix) == 0;
+}
+
+// 执行.loxc快照 文件映射进内存后顺序读取 不复制
+static InterpretResult runSnapshot(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    size_t size = (size_t)st.st_size;
+    void* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+
+    InterpretResult result = interpretSnapshot(data, size);
+    munmap(data, size);
+    return result;
+}
+
 // 用传入的文件路径读取文件 并解释执行
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+    if (hasSuffix(path, ".loxc")) {
+        result = runSnapshot(path);
+    } else {
+        char* source = readFile(path);
+        result = interpret(source);
+        free(source);
+    }
+    if (vm.gcReport) printGCStats();
+#ifdef OPEN_JIT
+    if (vm.jitReport) printJitStats(&vm);
+#endif
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// 编译源码并写成快照 不执行
+static void compileFile(const char* path, const char* output) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(source);
+    free(source);
+    if (function == NULL) exit(65);
+
+    push(OBJ_VAL(function));
+    if (!writeSnapshot(function, output)) {
+        fprintf(stderr, "Could not write file \"%s\".\n", output);
+        exit(74);
+    }
+    pop();
+}
+
+// 解析--开头的启动选项 返回第一个非选项参数的下标
+static int parseOptions(int argc, const char *argv[]) {
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+#ifdef OPEN_JIT
+        if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            vm.jitThreshold = atoi(argv[i] + 16);
+            continue;
+        }
+        if (strcmp(argv[i], "--jit-stats") == 0) {
+            vm.jitReport = true;
+            continue;
+        }
+        // 编译出的MIR模块按字节码哈希缓存在目录里 下次启动直接读取
+        if (strncmp(argv[i], "--jit-cache=", 12) == 0) {
+            vm.jitCacheDir = argv[i] + 12;
+            continue;
+        }
+        // 在解释器线程同步编译 不启动后台线程
+        if (strcmp(argv[i], "--jit-sync") == 0) {
+            vm.jitBackground = false;
+            continue;
+        }
+#endif
+        // 编译目标 默认只生成栈字节码
+        if (strcmp(argv[i], "--target=register") == 0) {
+            vm.registerTarget = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--target=stack") == 0) {
+            vm.registerTarget = false;
+            continue;
+        }
+        // 增量回收 标记和清扫分成不超过--gc-pause微秒的小片
+        if (strcmp(argv[i], "--gc=incremental") == 0) {
+            vm.gcIncremental = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--gc=generational") == 0) {
+            vm.gcIncremental = false;
+            continue;
+        }
+        if (strncmp(argv[i], "--gc-pause=", 11) == 0) {
+            vm.gcPause = (uint64_t)atoi(argv[i] + 11) * 1000;
+            continue;
+        }
+        // 完整回收时用多个线程并行标记
+        if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            vm.gcThreads = atoi(argv[i] + 13);
+            if (vm.gcThreads < 1) vm.gcThreads = 1;
+            continue;
+        }
+        // 把脚本编译成快照写入下一个参数 之后用lox out.loxc执行
+        if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compileOutput = argv[++i];
+            continue;
+        }
+        // 退出前打印回收次数和停顿时间
+        if (strcmp(argv[i], "--gc-stats") == 0) {
+            vm.gcReport = true;
+            continue;
+        }
+        fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+        exit(64);
+    }
+    return i;
+}
+
 int main(int argc, const char *argv[]) {
     initVM();
+    int first = parseOptions(argc, argv);
 
-    // 启动参数校验  一个参数为指令模式  两个参数为文件模式
-    if (argc == 1) {
+    // 启动参数校验  没有参数为指令模式  一个参数为文件模式
+    if (compileOutput != NULL && first == argc - 1) {
+        compileFile(argv[first], compileOutput);    // 只编译
+    } else if (compileOutput != NULL) {
+        fprintf(stderr, "Usage: clox --compile out.loxc path\n");
+        exit(64);
+    } else if (first == argc) {
         repl(); // 指令模式
-    } else if (argc == 2) {
-        runFile(argv[1]);   // 文件模式
+    } else if (first == argc - 1) {
+        runFile(argv[first]);   // 文件模式
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [options] [path]\n");
         exit(64);
     }
 
@@ -2,28 +2,63 @@
 // Created by Administrator on 2022/7/18.
 //
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
+#ifdef OPEN_JIT
+#include "jit.h"
+#endif
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+// DEBUG_STRESS_GC时每隔多少次回收做一次完整回收
+#define GC_STRESS_FULL_INTERVAL 64
+
+// 正在回收 回收时整理字符串表也会分配内存 这些分配不能再触发回收
+static bool collecting = false;
+
+// 分配内存前检查是否该回收
+static void collectIfNeeded() {
+    if (collecting) return;
+    collecting = true;
 #ifdef DEBUG_STRESS_GC
+    // 完整回收的时机和标记线程数无关 不同线程数的回收统计可以直接比较
+    static int stressCount = 0;
+    if (vm.gcIncremental) {
+        collectStep();
+    } else if (++stressCount % GC_STRESS_FULL_INTERVAL == 0) {
         collectGarbage();
+    } else {
+        collectYoung();
+    }
 #endif
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+    if (vm.gcIncremental) {
+        if (vm.bytesAllocated > vm.nextGCStep) {
+            collectStep();
         }
+    } else if (vm.bytesAllocated > vm.nextGC) {
+        collectGarbage();
+    } else if (vm.bytesAllocated > vm.nextYoungGC) {
+        collectYoung();
+    }
+    collecting = false;
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize) {
+        collectIfNeeded();
     }
 
     // 新长度为0是 释放该指针 返回null
@@ -38,8 +73,140 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+// 每级空闲块链表的头 空闲块的前8字节指向下一个空闲块
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+// 一个大小级别 先用空闲链表 再从当前页顺序切出新块
+typedef struct {
+    FreeBlock* free;  // 释放回来的块
+    char* bump;       // 当前页未切分部分的起点
+    char* limit;      // 当前页的末尾
+} SlabClass;
+
+// 向系统申请的页 串成链表 退出时一起释放
+typedef struct SlabPage {
+    struct SlabPage* next;
+} SlabPage;
+
+static SlabClass slabClasses[SLAB_CLASS_COUNT];
+static SlabPage* slabPages = NULL;
+
+// 大小对应的级别 按SLAB_GRANULE向上取整
+static inline int slabClass(size_t size) {
+    return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+// 给级别分配新页 页头之后按块大小切分
+static void *slabNewPage(SlabClass* slab, size_t blockSize) {
+    SlabPage* page = (SlabPage*)malloc(SLAB_PAGE_SIZE);
+    if (page == NULL) exit(1);
+    page->next = slabPages;
+    slabPages = page;
+
+    char* first = (char*)page + SLAB_GRANULE;
+    slab->bump = first + blockSize;
+    slab->limit = (char*)page + SLAB_PAGE_SIZE;
+    return first;
+}
+
+void *allocateSlab(size_t size) {
+    if (size > SLAB_MAX_SIZE) return reallocate(NULL, 0, size);
+
+    vm.bytesAllocated += size;
+    collectIfNeeded();
+
+    int index = slabClass(size);
+    size_t blockSize = (size_t)(index + 1) * SLAB_GRANULE;
+    SlabClass* slab = &slabClasses[index];
+    if (slab->free != NULL) {
+        FreeBlock* block = slab->free;
+        slab->free = block->next;
+        return block;
+    }
+    if (slab->limit - slab->bump >= (ptrdiff_t)blockSize) {
+        void* block = slab->bump;
+        slab->bump += blockSize;
+        return block;
+    }
+    return slabNewPage(slab, blockSize);
+}
+
+void freeSlab(void *pointer, size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        reallocate(pointer, size, 0);
+        return;
+    }
+
+    vm.bytesAllocated -= size;
+    FreeBlock* block = (FreeBlock*)pointer;
+    SlabClass* slab = &slabClasses[slabClass(size)];
+    block->next = slab->free;
+    slab->free = block;
+}
+
+// 释放所有页 页里的对象已经全部释放
+static void freeSlabPages() {
+    while (slabPages != NULL) {
+        SlabPage* next = slabPages->next;
+        free(slabPages);
+        slabPages = next;
+    }
+    memset(slabClasses, 0, sizeof(slabClasses));
+}
+
+// 并行标记线程 每个线程有自己的灰色对象栈
+typedef struct {
+    pthread_t thread;
+    Obj** stack;
+    int count;
+    int capacity;
+} Marker;
+
+// 标记线程共享的灰色对象池 线程的栈太长时分一批出来 栈空时从这里取
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+    Obj** stack;
+    int count;
+    int capacity;
+    int idle;     // 在等待的线程数 全部在等且池空时标记结束
+    int threads;  // 标记线程总数
+} markPool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+              .signal = PTHREAD_COND_INITIALIZER};
+
+// 当前线程的标记状态 串行标记时为NULL 灰色对象进vm.grayStack
+static __thread Marker* currentMarker = NULL;
+
+// 一次分给池子或从池子取走的对象数
+#define MARK_BATCH 64
+
+// 压入标记线程的栈
+static void markerPush(Marker* marker, Obj* object) {
+    if (marker->capacity < marker->count + 1) {
+        marker->capacity = GROW_CAPACITY(marker->capacity);
+        marker->stack = (Obj**)realloc(marker->stack,
+                                       sizeof(Obj*) * marker->capacity);
+
+        if (marker->stack == NULL) exit(1);
+    }
+    marker->stack[marker->count++] = object;
+}
+
+// 并行标记 标记位用原子交换 只有置位成功的线程把对象置灰
+static void markParallel(Marker* marker, Obj* object) {
+    if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) return;
+    if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) return;
+    markerPush(marker, object);
+}
+
 void markObject(Obj* object) {
     if (object == NULL) return;
+    if (currentMarker != NULL) {
+        markParallel(currentMarker, object);
+        return;
+    }
     if (object->isMarked) return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -63,6 +230,31 @@ void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
+void rememberObject(Obj* object) {
+    if (!object->isMarked || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.rememberedSet = (Obj**)realloc(vm.rememberedSet,
+                                          sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.rememberedSet == NULL) exit(1);
+    }
+
+    vm.rememberedSet[vm.rememberedCount++] = object;
+}
+
+void promoteObject(Obj* object) {
+    if (object == NULL || object->isMarked) return;
+    // 增量回收只在标记阶段需要 其余时候所有存活对象都是白色
+    if (vm.gcIncremental && vm.gcPhase != GC_MARK) return;
+    // 留在新生代链表里 下次回收时因为已标记而晋升
+    // 它引用的新对象要靠记忆集保住
+    object->isMarked = true;
+    rememberObject(object);
+}
+
 // 标记数组
 static void markArray(ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
@@ -102,19 +294,45 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // 缓存里的形状、类和方法是强引用 地址不会被新对象复用
+            if (function->inlineCaches != NULL) {
+                for (int i = 0; i < function->inlineCacheCount; i++) {
+                    InlineCacheEntry *entries = function->inlineCaches[i].entries;
+                    for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+                        markObject((Obj*)entries[j].shape);
+                        markObject((Obj*)entries[j].transition);
+                        markObject((Obj*)entries[j].klass);
+                        markObject((Obj*)entries[j].method);
+                    }
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
+        case OBJ_CONCAT:
+            markObject((Obj*)((ObjConcat*)object)->buffer);
+            break;
         case OBJ_NATIVE:
         case OBJ_STRING:
+        case OBJ_BUFFER:
             break;
     }
 }
@@ -143,28 +361,51 @@ static void freeObject(Obj *object) {
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
+            FREE_ARRAY(InlineCache, function->inlineCaches,
+                       function->inlineCaches != NULL ? function->inlineCacheCount : 0);
+#ifdef OPEN_JIT
+            FREE_ARRAY(uint8_t, function->typeProfile, function->chunk.count);
+            FREE_ARRAY(int, function->stackPcs, function->registerCode.capacity);
+#endif
             freeChunk(&function->chunk);
+            freeChunk(&function->registerCode);
             FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->capacity);
+            }
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
         case OBJ_STRING: {
             ObjString *string = (ObjString *) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            freeSlab(object, STRING_SIZE(string->length));
             break;
         }
         case OBJ_UPVALUE:
             FREE(ObjUpvalue, object);
             break;
+        case OBJ_CONCAT:
+            FREE(ObjConcat, object);
+            break;
+        case OBJ_BUFFER: {
+            ObjBuffer *buffer = (ObjBuffer *) object;
+            FREE_ARRAY(char, buffer->chars, buffer->capacity);
+            FREE(ObjBuffer, object);
+            break;
+        }
     }
 }
 
@@ -188,9 +429,16 @@ static void markRoots() {
     }
 
     // 全局变量
-    markTable(&vm.globals);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markTable(&vm.globalSlots);
     markCompilerRoots();
+    markSnapshotRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.rootShape);
+#ifdef OPEN_JIT
+    markJitRoots(&vm);
+#endif
 }
 
 // 跟踪对象
@@ -201,13 +449,116 @@ static void traceReferences() {
     }
 }
 
-// 清扫
+// 把栈底的一批对象分给池子 唤醒等待的线程
+static void shareWork(Marker* marker) {
+    pthread_mutex_lock(&markPool.mutex);
+    if (markPool.capacity < markPool.count + MARK_BATCH) {
+        markPool.capacity = markPool.count + MARK_BATCH * 4;
+        markPool.stack = (Obj**)realloc(markPool.stack,
+                                        sizeof(Obj*) * markPool.capacity);
+
+        if (markPool.stack == NULL) exit(1);
+    }
+    memcpy(markPool.stack + markPool.count, marker->stack,
+           sizeof(Obj*) * MARK_BATCH);
+    markPool.count += MARK_BATCH;
+    pthread_cond_broadcast(&markPool.signal);
+    pthread_mutex_unlock(&markPool.mutex);
+
+    marker->count -= MARK_BATCH;
+    memmove(marker->stack, marker->stack + MARK_BATCH,
+            sizeof(Obj*) * marker->count);
+}
+
+// 栈空后从池子取一批 所有线程都空闲且池子为空时返回false
+static bool takeWork(Marker* marker) {
+    pthread_mutex_lock(&markPool.mutex);
+    markPool.idle++;
+    while (markPool.count == 0 && markPool.idle < markPool.threads) {
+        pthread_cond_wait(&markPool.signal, &markPool.mutex);
+    }
+    if (markPool.count == 0) {
+        pthread_cond_broadcast(&markPool.signal);
+        pthread_mutex_unlock(&markPool.mutex);
+        return false;
+    }
+
+    markPool.idle--;
+    int count = markPool.count < MARK_BATCH ? markPool.count : MARK_BATCH;
+    markPool.count -= count;
+    for (int i = 0; i < count; i++) {
+        markerPush(marker, markPool.stack[markPool.count + i]);
+    }
+    pthread_mutex_unlock(&markPool.mutex);
+    return true;
+}
+
+// 标记线程 置黑自己栈里的对象 栈很长而池子空着时分出一批
+static void* markWorker(void* arg) {
+    Marker* marker = (Marker*)arg;
+    currentMarker = marker;
+    do {
+        while (marker->count > 0) {
+            blackenObject(marker->stack[--marker->count]);
+            if (marker->count > MARK_BATCH * 2 &&
+                __atomic_load_n(&markPool.count, __ATOMIC_RELAXED) == 0) {
+                shareWork(marker);
+            }
+        }
+    } while (takeWork(marker));
+    currentMarker = NULL;
+    return NULL;
+}
+
+// 多线程跟踪 根已经串行标记在vm.grayStack里 轮流分给各线程
+// 当前线程也作为一个标记线程
+static void traceParallel() {
+    int threads = vm.gcThreads;
+    Marker* markers = calloc(threads, sizeof(Marker));
+    if (markers == NULL) exit(1);
+    for (int i = 0; i < vm.grayCount; i++) {
+        markerPush(&markers[i % threads], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+    markPool.count = 0;
+    markPool.idle = 0;
+    markPool.threads = threads;
+
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&markers[started].thread, NULL, markWorker,
+                           &markers[started]) != 0) {
+            break;
+        }
+    }
+    // 线程没能全部启动时 没启动的部分由当前线程接着做
+    if (started < threads) {
+        pthread_mutex_lock(&markPool.mutex);
+        markPool.threads = started;
+        pthread_mutex_unlock(&markPool.mutex);
+        for (int i = started; i < threads; i++) {
+            for (int j = 0; j < markers[i].count; j++) {
+                markerPush(&markers[0], markers[i].stack[j]);
+            }
+        }
+    }
+    markWorker(&markers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(markers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(markers[i].stack);
+    }
+    free(markers);
+}
+
+// 清扫老对象 存活的保留标记 即仍是老对象
 static void sweep() {
     Obj* previous = NULL;
     Obj* object = vm.objects;
     while (object != NULL) {
         if (object->isMarked) {
-            object->isMarked = false;
             previous = object;
             object = object->next;
         } else {
@@ -224,18 +575,114 @@ static void sweep() {
     }
 }
 
+// 清扫新生代 标记过的晋升到老对象链表 其余释放
+static void sweepYoung() {
+    Obj* object = vm.youngObjects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        if (object->isMarked) {
+            object->next = vm.objects;
+            vm.objects = object;
+        } else {
+            freeObject(object);
+        }
+        object = next;
+    }
+    vm.youngObjects = NULL;
+}
+
+// 清空记忆集 回收后新生代为空 不再有老对象引用新对象
+static void clearRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.rememberedSet[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
+
+// 链表上的对象数
+static uint64_t countObjects(Obj* object) {
+    uint64_t count = 0;
+    for (; object != NULL; object = object->next) count++;
+    return count;
+}
+
+// 清除所有对象的标记 完整回收从头标记
+static void clearMarks(Obj* object) {
+    for (; object != NULL; object = object->next) {
+        object->isMarked = false;
+    }
+}
+
+// 单调时钟 纳秒
+static uint64_t nowNs() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// 记录一次从start开始的停顿
+static void recordPause(uint64_t start) {
+    uint64_t pause = nowNs() - start;
+    vm.gcStats.pauseCount++;
+    vm.gcStats.totalPause += pause;
+    if (pause > vm.gcStats.maxPause) vm.gcStats.maxPause = pause;
+}
+
+void collectYoung() {
+    uint64_t start = nowNs();
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    // 老对象已经标记 标记只会走到新对象
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.rememberedSet[i]);
+    }
+    clearRemembered();
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    sweepYoung();
+
+    vm.nextYoungGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+    vm.gcStats.minorCount++;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated,
+           vm.nextYoungGC);
+#endif
+}
+
 void collectGarbage() {
+    uint64_t start = nowNs();
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
 
+    clearMarks(vm.objects);
+    clearMarks(vm.youngObjects);
+    clearRemembered();
     markRoots();
-    traceReferences();
+    if (vm.gcThreads > 1) {
+        traceParallel();
+    } else {
+        traceReferences();
+    }
     tableRemoveWhite(&vm.strings);
     sweep();
+    sweepYoung();
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.nextYoungGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+    vm.gcStats.fullCount++;
+    // 存活的对象都在老对象链表里
+    vm.gcStats.liveObjects += countObjects(vm.objects);
+    recordPause(start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -245,13 +692,126 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-    Obj *object = vm.objects;
+// 增量回收的一片是否该结束 每做64个对象看一次时间
+static bool sliceExpired(int work, uint64_t start) {
+    if (vm.gcPause == 0) return true;
+    return (work & 63) == 0 && nowNs() - start >= vm.gcPause;
+}
+
+// 开始增量回收周期 此时所有对象都是白色 只把根置灰
+static void startCycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- incremental gc begin\n");
+#endif
+    clearRemembered();
+    markRoots();
+    vm.gcPhase = GC_MARK;
+    vm.gcStats.fullCount++;
+}
+
+// 结束标记 vm栈和全局变量的写入没有写屏障 要重新扫描根
+// 再扫描记忆集里被写入过白色对象的黑色对象 之后的分配都留到下个周期
+static void finishMark() {
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.rememberedSet[i]);
+    }
+    clearRemembered();
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+
+    vm.sweepObjects = vm.objects;
+    vm.sweepYoung = vm.youngObjects;
+    vm.objects = NULL;
+    vm.youngObjects = NULL;
+    vm.gcPhase = GC_SWEEP;
+}
+
+// 清扫一个对象 存活的变回白色放进老对象链表 没有待清扫的对象时返回false
+static bool sweepStep() {
+    Obj** list = vm.sweepObjects != NULL ? &vm.sweepObjects : &vm.sweepYoung;
+    Obj* object = *list;
+    if (object == NULL) return false;
+
+    *list = object->next;
+    if (object->isMarked) {
+        object->isMarked = false;
+        object->next = vm.objects;
+        vm.objects = object;
+        vm.gcStats.liveObjects++;
+    } else {
+        freeObject(object);
+    }
+    return true;
+}
+
+void collectStep() {
+    uint64_t start = nowNs();
+    int work = 0;
+    switch (vm.gcPhase) {
+        case GC_IDLE:
+            startCycle();
+            break;
+        case GC_MARK:
+            do {
+                if (vm.grayCount == 0) {
+                    finishMark();
+                    break;
+                }
+                blackenObject(vm.grayStack[--vm.grayCount]);
+            } while (!sliceExpired(++work, start));
+            break;
+        case GC_SWEEP:
+            do {
+                if (!sweepStep()) {
+                    vm.gcPhase = GC_IDLE;
+                    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+                    printf("-- incremental gc end next at %zu\n", vm.nextGC);
+#endif
+                    break;
+                }
+            } while (!sliceExpired(++work, start));
+            break;
+    }
+
+    vm.nextGCStep = vm.gcPhase == GC_IDLE ? vm.nextGC
+                                          : vm.bytesAllocated + GC_STEP_SIZE;
+    recordPause(start);
+}
+
+void printGCStats() {
+    GCStats* stats = &vm.gcStats;
+    fprintf(stderr, "[gc] %s: %d minor, %d full, %d pauses\n",
+            vm.gcIncremental ? "incremental" : "generational",
+            stats->minorCount, stats->fullCount, stats->pauseCount);
+    fprintf(stderr, "[gc] %llu objects survived full collections\n",
+            (unsigned long long)stats->liveObjects);
+    fprintf(stderr, "[gc] pause total %.3f ms, max %.3f ms, mean %.3f ms\n",
+            stats->totalPause / 1e6, stats->maxPause / 1e6,
+            stats->pauseCount > 0 ? stats->totalPause / 1e6 / stats->pauseCount
+                                  : 0.0);
+}
+
+// 释放链表上的所有对象
+static void freeList(Obj *object) {
     while (object != NULL) {
         Obj *next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() {
+    freeList(vm.objects);
+    freeList(vm.youngObjects);
+    freeList(vm.sweepObjects);
+    freeList(vm.sweepYoung);
+    freeSlabPages();
 
     free(vm.grayStack);
+    free(vm.rememberedSet);
+    free(markPool.stack);
+    markPool.stack = NULL;
+    markPool.capacity = 0;
 }
\ No newline at end of file
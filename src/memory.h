@@ -9,6 +9,15 @@
 #include "object.h"
 
 
+// 新生代大小 上次回收后新分配的字节数超过它时回收新生代
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// 增量回收进行中 每分配这么多字节做一片回收
+#define GC_STEP_SIZE (64 * 1024)
+
+// 增量回收每片默认的时间预算 纳秒
+#define GC_DEFAULT_PAUSE (1000 * 1000)
+
 // 初始分配内存
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -19,8 +28,15 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
-// 释放对象
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+// 释放对象 对象内存来自allocateSlab
+#define FREE(type, pointer) freeSlab(pointer, sizeof(type))
+
+// 对象按大小分级 同一级的块从SLAB_PAGE_SIZE大小的页里切出
+// 块大小是SLAB_GRANULE的倍数 超过SLAB_MAX_SIZE的对象直接用reallocate
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_CLASS_COUNT 16
+#define SLAB_MAX_SIZE (SLAB_GRANULE * SLAB_CLASS_COUNT)
 
 // 动态数组容量调整 类型 void指针 旧长度 新长度
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
@@ -29,15 +45,45 @@
 // 重新分配内存 扩容或者缩容 取决于新旧长度的大小
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+// 分配对象内存 先取同级的空闲块 没有再从页里切 计入bytesAllocated并可能触发回收
+void *allocateSlab(size_t size);
+
+// 释放对象内存 块放回同级的空闲链表 size必须与分配时相同
+void freeSlab(void *pointer, size_t size);
+
 // 标记对象
 void markObject(Obj* object);
 
 // 标记值
 void markValue(Value value);
 
-// 执行一次垃圾回收
+// 执行一次完整的垃圾回收 新老对象一起标记清扫
 void collectGarbage();
 
+// 增量回收的一片 空闲时开始新周期 否则在时间预算内推进标记或清扫
+void collectStep();
+
+// 只回收新生代 从根和记忆集出发标记新对象 存活的新对象晋升为老对象
+void collectYoung();
+
+// 把老对象记入记忆集 下次新生代回收时扫描它引用的新对象
+// 新对象或已在记忆集中时什么也不做
+void rememberObject(Obj* object);
+
+// 把新对象提前晋升 用于不知道引用方是谁的写入(如内联缓存)
+void promoteObject(Obj* object);
+
+// 写屏障 往object里写入value之后调用
+// 两次回收之间isMarked为true的就是老对象 老对象引用新对象时记入记忆集
+static inline void writeBarrier(Obj* object, Value value) {
+    if (object->isMarked && IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+        rememberObject(object);
+    }
+}
+
+// 打印垃圾回收的次数和停顿时间
+void printGCStats();
+
 // 释放虚拟机根链的对象
 void freeObjects();
 
@@ -17,13 +17,14 @@
 
 // 分配对象
 static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)allocateSlab(size);
     object->type = type;
     object->isMarked = false;
+    object->isRemembered = false;
 
-    // 串进虚拟机根链表中
-    object->next = vm.objects;
-    vm.objects = object;
+    // 新对象串进新生代链表 回收后存活的再移到老对象链表
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -56,10 +57,6 @@ ObjClosure *newClosure(ObjFunction *function) {
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
-
-#ifdef OPEN_JIT
-    closure->jitFunction = NULL;
-#endif
     return closure;
 }
 
@@ -68,29 +65,96 @@ ObjFunction *newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->inlineCacheCount = 0;
+    function->inlineCaches = NULL;
+#ifdef OPEN_JIT
+    function->jitFunction = NULL;
+    function->osrFunction = NULL;
+    function->callCount = 0;
+    function->loopCount = 0;
+    function->typeProfile = NULL;
+    function->stackPcs = NULL;
+#endif
     initChunk(&function->chunk);
+    initChunk(&function->registerCode);
     return function;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
     ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.rootShape;
+    instance->fields = instance->inlineFields;
+    instance->capacity = INSTANCE_INLINE_FIELDS;
     return instance;
 }
 
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+// 沿形状链向根查找
+int shapeFindField(ObjShape *shape, ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->fieldCount - 1;
+        }
+    }
+    return -1;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return (ObjShape *)AS_OBJ(next);
+    }
+
+    ObjShape *child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    rememberObject((Obj *)shape);
+    pop();
+    return child;
+}
+
+void instanceAddField(ObjInstance *instance, ObjShape *shape, Value value) {
+    int index = shape->fieldCount - 1;
+    if (index >= instance->capacity) {
+        // 分配期间可能GC 实例仍保持旧的形状和字段
+        int capacity = GROW_CAPACITY(instance->capacity);
+        Value *fields = ALLOCATE(Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * instance->capacity);
+        if (instance->fields != instance->inlineFields) {
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
+        }
+        instance->fields = fields;
+        instance->capacity = capacity;
+    }
+    instance->fields[index] = value;
+    instance->shape = shape;
+    writeBarrier((Obj *)instance, value);
+    writeBarrier((Obj *)instance, OBJ_VAL(shape));
+}
+
 ObjNative *newNative(NativeFn function) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-// 分配字符串
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// 分配字符串 对象和字符一次分配
+static ObjString *allocateString(const char *chars, int length, uint32_t hash) {
+    ObjString *string =
+        (ObjString *)allocateObject(STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -98,26 +162,74 @@ static ObjString *allocateString(char *chars, int length, uint32_t hash) {
     return string;
 }
 
-// 计算哈希值
-static uint32_t hashString(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
-    return hash;
+// wyhash的常数
+#define WY_SECRET0 0xa0761d6478bd642full
+#define WY_SECRET1 0xe7037ed1a0b428dbull
+#define WY_SECRET2 0x8ebc6af09c88c6e3ull
+#define WY_SECRET3 0x589965cc75374cc3ull
+
+// 读取未对齐的8字节和4字节
+static inline uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-ObjString *takeString(char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    // 如果在全局字符串中匹配到了   则释放这个用全局的字符串
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
+static inline uint64_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    return allocateString(chars, length, hash);
+// 64位乘法的128位结果 高低两半异或
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// 计算哈希值 wyhash 每次处理8到48字节
+// 不超过16字节的字符串用几次重叠的读取凑成两个64位数 不逐字节循环
+static uint32_t hashString(const char *key, int length) {
+    const char *p = key;
+    size_t len = (size_t)length;
+    uint64_t seed = wymix(WY_SECRET0, WY_SECRET1);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) |
+                ((uint64_t)(uint8_t)p[len >> 1] << 8) | (uint8_t)p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(read64(p) ^ WY_SECRET1, read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ WY_SECRET2, read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ WY_SECRET3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ WY_SECRET1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    __uint128_t r = (__uint128_t)(a ^ WY_SECRET1) * (b ^ seed);
+    return (uint32_t)wymix((uint64_t)r ^ WY_SECRET0 ^ len,
+                           (uint64_t)(r >> 64) ^ WY_SECRET1);
 }
 
 ObjString *copyString(const char *chars, int length) {
@@ -127,10 +239,7 @@ ObjString *copyString(const char *chars, int length) {
     if (interned != NULL)
         return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(chars, length, hash);
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -150,6 +259,32 @@ static void printFunction(ObjFunction *function) {
     printf("<fn %s>", function->name->chars);
 }
 
+ObjBuffer *newBuffer(int capacity) {
+    ObjBuffer *buffer = ALLOCATE_OBJ(ObjBuffer, OBJ_BUFFER);
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->chars = NULL;
+    push(OBJ_VAL(buffer));
+    buffer->chars = ALLOCATE(char, capacity);
+    buffer->capacity = capacity;
+    pop();
+    return buffer;
+}
+
+ObjConcat *newConcat(ObjBuffer *buffer, int length) {
+    ObjConcat *concat = ALLOCATE_OBJ(ObjConcat, OBJ_CONCAT);
+    concat->buffer = buffer;
+    concat->length = length;
+    return concat;
+}
+
+bool stringsEqual(Value a, Value b) {
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+    int length = stringLength(a);
+    return length == stringLength(b) &&
+           memcmp(stringChars(a), stringChars(b), length) == 0;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
@@ -176,5 +311,15 @@ void printObject(Value value) {
     case OBJ_UPVALUE:
         printf("upvalue");
         break;
+    case OBJ_SHAPE:
+        printf("shape");
+        break;
+    case OBJ_CONCAT:
+        printf("%.*s", AS_CONCAT(value)->length,
+               AS_CONCAT(value)->buffer->chars);
+        break;
+    case OBJ_BUFFER:
+        printf("buffer");
+        break;
     }
 }
@@ -27,6 +27,10 @@
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 // 是否为字符串对象
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+// 是否为拼接得到的字符串
+#define IS_CONCAT(value) isObjType(value, OBJ_CONCAT)
+// 是否为字符串值 包括拼接结果
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_CONCAT(value))
 
 // 转化为方法对象
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
@@ -44,6 +48,8 @@
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 // 对象字符创转化为c字符串
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+// 转化为拼接结果
+#define AS_CONCAT(value) ((ObjConcat *)AS_OBJ(value))
 
 // 对象类型枚举
 typedef enum {
@@ -55,15 +61,54 @@ typedef enum {
     OBJ_NATIVE,       // 原生函数对象
     OBJ_STRING,       // 字符串对象
     OBJ_UPVALUE,      // 闭包提升值对象
+    OBJ_SHAPE,        // 实例形状对象 不会作为值出现
+    OBJ_CONCAT,       // 拼接得到的长字符串 不驻留
+    OBJ_BUFFER,       // 拼接结果共用的字符缓冲区 不会作为值出现
 } ObjType;
 
 // 对象结构体
 struct Obj {
     ObjType type;     // 对象类型
-    bool isMarked;    // 是否被标记
+    bool isMarked;    // 是否被标记 两次回收之间表示是否为老对象
+    bool isRemembered;// 是否在记忆集中
     struct Obj *next; // 下一个对象
 };
 
+struct ObjClass;
+struct ObjClosure;
+struct ObjShape;
+
+// 内联缓存的项数 记满后不再记录新的形状
+#define INLINE_CACHE_SIZE 4
+
+// 内联缓存项 按接收者的形状记录一次查找的结果
+// 字段项: index为字段下标
+// 新增字段项: 赋值前的形状加入字段后变为transition 新字段的下标为index
+// 方法项: index为-1 形状相同说明实例没有同名字段 再按类取方法
+typedef struct {
+    struct ObjShape *shape;      // 接收者的形状 NULL为空项
+    struct ObjShape *transition; // 新增字段后的形状 其余项为NULL
+    struct ObjClass *klass;      // 方法项对应的类
+    struct ObjClosure *method;   // 类中找到的方法
+    int index;                   // 字段下标 -1表示方法
+} InlineCacheEntry;
+
+// 属性访问和方法调用指令的内联缓存 解释器和JIT共用
+// 先是单态 遇到新的形状再补项 最多INLINE_CACHE_SIZE项
+typedef struct {
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
+#ifdef OPEN_JIT
+// JIT编译出的函数 参数为VM和被调用的闭包 返回InterpretResult
+// 同一函数的所有闭包共用一份机器码
+typedef int (*JitFunction)(void *, struct ObjClosure *);
+
+// 算术指令观察到的操作数类型 按位或累积
+#define TYPE_PROFILE_NUMBER 1 // 操作数都是数字
+#define TYPE_PROFILE_OTHER 2  // 出现过不是数字的操作数
+#endif
+
 // 函数对象结构体
 typedef struct {
     Obj obj;          // 公共对象头
@@ -71,6 +116,18 @@ typedef struct {
     int upvalueCount; // 提升值数
     Chunk chunk;      // 函数的字节码块
     ObjString *name;  // 函数名
+    int inlineCacheCount;        // 内联缓存数
+    InlineCache *inlineCaches;   // 按指令操作数编号的内联缓存
+    Chunk registerCode;          // 寄存器字节码 为空时解释执行chunk 常量用chunk的常量表
+
+#ifdef OPEN_JIT
+    JitFunction jitFunction; // 编译后的机器码
+    JitFunction osrFunction; // 从循环头进入的机器码
+    int callCount;    // 解释执行时的调用次数
+    int loopCount;    // 解释执行时的回边次数
+    uint8_t *typeProfile;    // 按字节码偏移记录的操作数类型
+    int *stackPcs;           // 寄存器字节码偏移 -> 对应栈字节码偏移 容量同registerCode
+#endif
 } ObjFunction;
 
 // 原生函数 函数指针
@@ -82,14 +139,37 @@ typedef struct {
     NativeFn function; // 原生函数指针
 } ObjNative;
 
-// 字符串对象结构体
+// 字符串对象结构体 字符紧跟在对象后面 和对象一起分配
 struct ObjString {
     Obj obj;       // 公共对象头
     int length;    // 字符串长度
-    char *chars;   // 字符串指针
     uint32_t hash; // 哈希值
+    char chars[];  // 字符 以'\0'结尾
 };
 
+// 长度为length的字符串对象占用的字节数
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// 拼接结果不短于这个长度时才用拼接缓冲区 更短的照旧驻留
+#define CONCAT_MIN_LENGTH 32
+
+// 拼接缓冲区 s = s + x 这样的循环在缓冲区末尾追加 不用每次复制整个字符串
+typedef struct {
+    Obj obj;       // 公共对象头
+    int length;    // 已写入的字符数
+    int capacity;  // chars容量
+    char *chars;   // 字符 不以'\0'结尾
+} ObjBuffer;
+
+// 拼接结果 内容是缓冲区的前length个字符
+// 长度等于缓冲区已写入长度时 它是缓冲区的末尾 再拼接可以原地追加
+// 不哈希也不驻留 和其他字符串按内容比较
+typedef struct {
+    Obj obj;            // 公共对象头
+    ObjBuffer *buffer;  // 共用的缓冲区
+    int length;         // 字符数
+} ObjConcat;
+
 // 提升值
 typedef struct ObjUpvalue {
     Obj obj;                 // 公共对象头
@@ -104,24 +184,36 @@ typedef struct ObjClosure{
     ObjFunction *function; // 裸函数
     ObjUpvalue **upvalues; // 提升值数组
     int upvalueCount;      // 提升值数量
-
-#ifdef OPEN_JIT
-    int(*jitFunction)(void*, struct ObjClosure*);
-#endif
 } ObjClosure;
 
 // 类对象
-typedef struct {
+typedef struct ObjClass {
     Obj obj;         // 公共对象头
     ObjString *name; // 类名
     Table methods;   // 类方法
 } ObjClass;
 
+// 形状 描述实例有哪些字段以及各字段的下标
+// 按相同顺序加入相同字段的实例共用一个形状 形状构成以空形状为根的转移树
+typedef struct ObjShape {
+    Obj obj;                 // 公共对象头
+    struct ObjShape *parent; // 去掉最后一个字段的形状 根为NULL
+    ObjString *name;         // 最后加入的字段名 下标为fieldCount - 1
+    int fieldCount;          // 字段数
+    Table transitions;       // 字段名 -> 加入该字段后的形状
+} ObjShape;
+
+// 直接放在实例里的字段数 超过后字段移到单独分配的数组
+#define INSTANCE_INLINE_FIELDS 4
+
 // 实例对象
 typedef struct {
     Obj obj;
-    ObjClass *klass;
-    Table fields;
+    ObjClass *klass;         // 所属类
+    ObjShape *shape;         // 字段布局
+    Value *fields;           // 字段值 按形状中的下标存放
+    int capacity;            // fields容量
+    Value inlineFields[INSTANCE_INLINE_FIELDS]; // 字段少时fields指向这里
 } ObjInstance;
 
 // 绑定方法对象
@@ -146,24 +238,60 @@ ObjFunction *newFunction();
 // 新建一个实例对象
 ObjInstance *newInstance(ObjClass *klass);
 
+// 新建形状 parent加上字段name 根形状两者都为NULL
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+
+// 在形状中查找字段下标 不存在返回-1
+int shapeFindField(ObjShape *shape, ObjString *name);
+
+// 加入字段后的形状 同一形状加入同名字段总是得到同一个形状
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+
+// 给实例加入新字段 shape为加入后的形状
+void instanceAddField(ObjInstance *instance, ObjShape *shape, Value value);
+
 // 新建一个原生函数
 ObjNative *newNative(NativeFn function);
 
-// 取c字符串成字符串类型
-ObjString *takeString(char *chars, int length);
-
 // 在堆中复制字符创 并返回指针
 ObjString *copyString(const char *chars, int length);
 
 // 新建提升值
 ObjUpvalue *newUpvalue(Value *slot);
 
+// 新建容量为capacity的拼接缓冲区 分配字符期间缓冲区在vm栈上
+ObjBuffer *newBuffer(int capacity);
+
+// 新建拼接结果 调用方要保证buffer可达
+ObjConcat *newConcat(ObjBuffer *buffer, int length);
+
+// 两个值是否为内容相同的字符串 用于至少一边是拼接结果时
+bool stringsEqual(Value a, Value b);
+
 // 打印对象
 void printObject(Value value);
 
+// 解释器进入函数时执行的第一条指令 有寄存器字节码时执行寄存器字节码
+static inline uint8_t *entryCode(ObjFunction *function) {
+    return function->registerCode.count > 0 ? function->registerCode.code
+                                            : function->chunk.code;
+}
+
 // 内联函数判断对象是否为指定类型
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// 字符串值的字符 不一定以'\0'结尾
+static inline const char *stringChars(Value value) {
+    return IS_STRING(value) ? AS_CSTRING(value)
+                            : AS_CONCAT(value)->buffer->chars;
+}
+
+// 字符串值的长度
+static inline int stringLength(Value value) {
+    return IS_STRING(value) ? AS_STRING(value)->length
+                            : AS_CONCAT(value)->length;
+}
+
 #endif
@@ -0,0 +1,557 @@
+//
+// 寄存器字节码 由栈字节码翻译而来
+// 寄存器r就是栈帧中的槽r 栈字节码在栈深度r处的值翻译后放在寄存器r
+// 翻译时维护一个虚拟栈 局部变量和常量压栈时只记下来源 不生成指令
+// 要用到时才作为操作数直接引用 跳转、调用和栈指令前再写回各自的寄存器
+//
+
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "register.h"
+
+// 虚拟栈上的值在哪
+typedef enum {
+    OPERAND_REGISTER, // 在寄存器index中 index等于所在栈深度时已写回
+    OPERAND_CONSTANT, // 常量index 还没有装入寄存器
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int index;
+} Operand;
+
+// 待回填的前向跳转
+typedef struct {
+    int offset; // 两字节跳转偏移在寄存器字节码中的位置 偏移从它之后算起
+    int target; // 栈字节码中的跳转目标
+} JumpPatch;
+
+typedef struct {
+    ObjFunction *function;
+    Chunk *chunk;                // 栈字节码
+    Chunk *out;                  // 寄存器字节码
+    int *depths;                 // 每条栈指令执行前的栈深度
+    bool *targets;               // 跳转目标 经过时虚拟栈要全部写回
+    int *offsets;                // 跳转目标在寄存器字节码中的偏移
+    Operand stack[UINT8_COUNT];  // 虚拟栈
+    int depth;                   // 虚拟栈深度
+    int pc;                      // 正在翻译的栈指令
+    int last;                    // 最后一条寄存器指令的偏移 之后经过了跳转目标时为-1
+    int lastPc;                  // 最后一条寄存器指令对应的栈指令
+    JumpPatch *patches;
+    int patchCount;
+    int patchCapacity;
+} RegisterCompiler;
+
+// 写入一个字节 行号和类型记录位置沿用正在翻译的栈指令
+static void emitByte(RegisterCompiler *rc, uint8_t byte) {
+    Chunk *out = rc->out;
+#ifdef OPEN_JIT
+    // stackPcs与寄存器字节码同步扩容
+    if (out->capacity < out->count + 1) {
+        int capacity = GROW_CAPACITY(out->capacity);
+        rc->function->stackPcs = GROW_ARRAY(int, rc->function->stackPcs,
+                                            out->capacity, capacity);
+    }
+    rc->function->stackPcs[out->count] = rc->pc;
+#endif
+    writeChunk(out, byte, rc->chunk->lines[rc->pc]);
+}
+
+// 开始一条寄存器指令
+static void emitOp(RegisterCompiler *rc, uint8_t op) {
+    rc->last = rc->out->count;
+    rc->lastPc = rc->pc;
+    emitByte(rc, op);
+}
+
+static void emitShort(RegisterCompiler *rc, uint16_t value) {
+    emitByte(rc, (value >> 8) & 0xff);
+    emitByte(rc, value & 0xff);
+}
+
+// 写入跳到栈字节码target处的偏移 翻译完再回填
+static void emitJump(RegisterCompiler *rc, int target) {
+    if (rc->patchCount == rc->patchCapacity) {
+        rc->patchCapacity = GROW_CAPACITY(rc->patchCapacity);
+        rc->patches =
+            realloc(rc->patches, sizeof(JumpPatch) * rc->patchCapacity);
+    }
+    rc->patches[rc->patchCount].offset = rc->out->count;
+    rc->patches[rc->patchCount].target = target;
+    rc->patchCount++;
+    emitShort(rc, 0xffff);
+}
+
+static void push(RegisterCompiler *rc, OperandKind kind, int index) {
+    rc->stack[rc->depth].kind = kind;
+    rc->stack[rc->depth].index = index;
+    rc->depth++;
+}
+
+// 栈深度slot处的值所在的寄存器 常量先装入寄存器slot
+static int operandRegister(RegisterCompiler *rc, int slot) {
+    Operand *operand = &rc->stack[slot];
+    if (operand->kind == OPERAND_CONSTANT) {
+        emitOp(rc, OP_REG_LOADK);
+        emitByte(rc, slot);
+        emitByte(rc, operand->index);
+        operand->kind = OPERAND_REGISTER;
+        operand->index = slot;
+    }
+    return operand->index;
+}
+
+// 把栈深度slot处的值写回寄存器slot
+static void materialize(RegisterCompiler *rc, int slot) {
+    Operand *operand = &rc->stack[slot];
+    if (operand->kind == OPERAND_CONSTANT) {
+        operandRegister(rc, slot);
+    } else if (operand->index != slot) {
+        emitOp(rc, OP_REG_MOVE);
+        emitByte(rc, slot);
+        emitByte(rc, operand->index);
+        operand->index = slot;
+    }
+}
+
+// 虚拟栈底部count个值全部写回 此后寄存器与栈字节码的栈一致
+// 引用的寄存器总在引用者下面 从下往上写回不会覆盖还要读的值
+static void flush(RegisterCompiler *rc, int count) {
+    for (int slot = 0; slot < count; slot++) {
+        materialize(rc, slot);
+    }
+}
+
+// 改写寄存器reg前 还引用它旧值的位置先写回
+static void protect(RegisterCompiler *rc, int reg) {
+    for (int slot = 0; slot < rc->depth; slot++) {
+        Operand *operand = &rc->stack[slot];
+        if (slot != reg && operand->kind == OPERAND_REGISTER &&
+            operand->index == reg) {
+            materialize(rc, slot);
+        }
+    }
+}
+
+// 跳转目标处虚拟栈都已写回
+static void resetStack(RegisterCompiler *rc, int depth) {
+    rc->depth = 0;
+    while (rc->depth < depth) {
+        push(rc, OPERAND_REGISTER, rc->depth);
+    }
+}
+
+// 第一个操作数是目标寄存器A的指令 可以直接改写A
+static bool writesRegister(uint8_t op) {
+    switch (op) {
+    case OP_REG_MOVE:
+    case OP_REG_LOADK:
+    case OP_REG_NIL:
+    case OP_REG_TRUE:
+    case OP_REG_FALSE:
+    case OP_REG_GET_GLOBAL:
+    case OP_REG_GET_UPVALUE:
+    case OP_REG_EQUAL:
+    case OP_REG_GREATER:
+    case OP_REG_LESS:
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+    case OP_REG_GREATER_K:
+    case OP_REG_LESS_K:
+    case OP_REG_ADD_K:
+    case OP_REG_SUBTRACT_K:
+    case OP_REG_MULTIPLY_K:
+    case OP_REG_DIVIDE_K:
+    case OP_REG_NOT:
+    case OP_REG_NEGATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// OP_SET_LOCAL 栈顶的值写入局部变量slot 值留在栈顶
+static void setLocal(RegisterCompiler *rc, int slot) {
+    int top = rc->depth - 1;
+    Operand value = rc->stack[top];
+    if (value.kind == OPERAND_REGISTER && value.index == slot) {
+        return;
+    }
+    int last = rc->last;
+    protect(rc, slot);
+    if (value.kind == OPERAND_REGISTER && value.index == top &&
+        rc->last == last && last >= 0 &&
+        writesRegister(rc->out->code[last]) &&
+        rc->out->code[last + 1] == top) {
+        // 值刚由上一条指令算出 让它直接写入局部变量
+        rc->out->code[last + 1] = slot;
+    } else if (value.kind == OPERAND_REGISTER) {
+        emitOp(rc, OP_REG_MOVE);
+        emitByte(rc, slot);
+        emitByte(rc, value.index);
+    } else {
+        emitOp(rc, OP_REG_LOADK);
+        emitByte(rc, slot);
+        emitByte(rc, value.index);
+    }
+    rc->stack[slot].kind = OPERAND_REGISTER;
+    rc->stack[slot].index = slot;
+    rc->stack[top] = rc->stack[slot];
+}
+
+// 右操作数为数字常量时使用的指令 没有则为0
+static uint8_t constantForm(uint8_t op) {
+    switch (op) {
+    case OP_REG_GREATER: return OP_REG_GREATER_K;
+    case OP_REG_LESS: return OP_REG_LESS_K;
+    case OP_REG_ADD: return OP_REG_ADD_K;
+    case OP_REG_SUBTRACT: return OP_REG_SUBTRACT_K;
+    case OP_REG_MULTIPLY: return OP_REG_MULTIPLY_K;
+    case OP_REG_DIVIDE: return OP_REG_DIVIDE_K;
+    default: return 0;
+    }
+}
+
+// 二元运算 结果放在左操作数的栈深度
+static void binaryOp(RegisterCompiler *rc, uint8_t op) {
+    int result = rc->depth - 2;
+    Operand right = rc->stack[rc->depth - 1];
+    uint8_t constantOp = constantForm(op);
+    bool useConstant =
+        constantOp != 0 && right.kind == OPERAND_CONSTANT &&
+        IS_NUMBER(rc->chunk->constants.values[right.index]);
+    // 拼接字符串会触发GC 栈顶以下的槽要先写回 GC按栈标记
+    if (op == OP_REG_ADD && !useConstant) {
+        flush(rc, result);
+    }
+
+    int a = operandRegister(rc, result);
+    int b = useConstant ? right.index : operandRegister(rc, rc->depth - 1);
+    emitOp(rc, useConstant ? constantOp : op);
+    emitByte(rc, result);
+    emitByte(rc, a);
+    emitByte(rc, b);
+    if (op == OP_REG_ADD && !useConstant) {
+        emitByte(rc, result);
+    }
+    rc->depth = result;
+    push(rc, OPERAND_REGISTER, result);
+}
+
+// 一元运算 结果放回操作数的栈深度
+static void unaryOp(RegisterCompiler *rc, uint8_t op) {
+    int top = rc->depth - 1;
+    int source = operandRegister(rc, top);
+    emitOp(rc, op);
+    emitByte(rc, top);
+    emitByte(rc, source);
+    rc->stack[top].kind = OPERAND_REGISTER;
+    rc->stack[top].index = top;
+}
+
+// 上一条是结果寄存器为reg的比较指令时 改写为比较失败就跳转的指令
+static bool fuseCompare(RegisterCompiler *rc, int reg, int target) {
+    if (rc->last < 0 || rc->last + 4 != rc->out->count) {
+        return false;
+    }
+    uint8_t *code = &rc->out->code[rc->last];
+    uint8_t op;
+    switch (code[0]) {
+    case OP_REG_LESS: op = OP_REG_JUMP_IF_NOT_LESS; break;
+    case OP_REG_LESS_K: op = OP_REG_JUMP_IF_NOT_LESS_K; break;
+    case OP_REG_GREATER: op = OP_REG_JUMP_IF_NOT_GREATER; break;
+    case OP_REG_GREATER_K: op = OP_REG_JUMP_IF_NOT_GREATER_K; break;
+    default: return false;
+    }
+    if (code[1] != reg) {
+        return false;
+    }
+    uint8_t a = code[2];
+    uint8_t b = code[3];
+    // 类型记录仍记在比较指令处
+    int pc = rc->pc;
+    rc->pc = rc->lastPc;
+    rc->out->count = rc->last;
+    emitOp(rc, op);
+    emitByte(rc, a);
+    emitByte(rc, b);
+    emitJump(rc, target);
+    rc->pc = pc;
+    return true;
+}
+
+// OP_JUMP_IF_FALSE
+static void jumpIfFalse(RegisterCompiler *rc, int target) {
+    uint8_t *code = rc->chunk->code;
+    int top = rc->depth - 1;
+    // if和while的条件在两条路径上都紧接着弹出 不用写回
+    // 为假时跳过目标处的OP_POP
+    if (code[rc->pc + 3] == OP_POP && !rc->targets[rc->pc + 3] &&
+        code[target] == OP_POP) {
+        flush(rc, top);
+        Operand *condition = &rc->stack[top];
+        if (condition->kind == OPERAND_REGISTER && condition->index == top &&
+            fuseCompare(rc, top, target + 1)) {
+            return;
+        }
+        int source = operandRegister(rc, top);
+        emitOp(rc, OP_REG_JUMP_IF_FALSE);
+        emitByte(rc, source);
+        emitJump(rc, target + 1);
+        return;
+    }
+    flush(rc, rc->depth);
+    emitOp(rc, OP_REG_JUMP_IF_FALSE);
+    emitByte(rc, top);
+    emitJump(rc, target);
+}
+
+// 不能翻译成寄存器指令的栈指令 写回虚拟栈后原样嵌入
+static void embedStackInstruction(RegisterCompiler *rc) {
+    flush(rc, rc->depth);
+    emitOp(rc, OP_REG_STACK);
+    emitByte(rc, rc->depth);
+    int length = instructionLength(rc->chunk, rc->pc);
+    for (int i = 0; i < length; i++) {
+        emitByte(rc, rc->chunk->code[rc->pc + i]);
+    }
+    resetStack(rc, rc->depth + stackEffect(rc->chunk, rc->pc));
+}
+
+// 每条栈指令执行前的栈深度和跳转目标
+// 编译器按语句保持栈深度一致 顺序扫描即可 无条件跳转后沿用跳转目标记下的深度
+static bool analyze(RegisterCompiler *rc) {
+    Chunk *chunk = rc->chunk;
+    uint8_t *code = chunk->code;
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        int target = -1;
+        switch (code[pc]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            target = pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]);
+            break;
+        case OP_LOOP:
+            target = pc + 3 - ((code[pc + 1] << 8) | code[pc + 2]);
+            break;
+        }
+        if (target < 0) continue;
+        rc->targets[target] = true;
+        if (code[pc] == OP_JUMP_IF_FALSE && code[target] == OP_POP) {
+            rc->targets[target + 1] = true;
+        }
+    }
+
+    int depth = rc->function->arity + 1;
+    bool reachable = true;
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        if (!reachable && rc->depths[pc] >= 0) {
+            depth = rc->depths[pc];
+        }
+        rc->depths[pc] = depth;
+        uint8_t op = code[pc];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
+            int target = pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]);
+            if (rc->depths[target] < 0) {
+                rc->depths[target] = depth;
+            }
+        }
+        // 返回语句之后的死代码按语句结束时的深度继续
+        depth += op == OP_RETURN ? -1 : stackEffect(chunk, pc);
+        if (depth > UINT8_COUNT) {
+            return false;
+        }
+        reachable = op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+    }
+    return true;
+}
+
+// 逐条翻译栈指令
+static bool translate(RegisterCompiler *rc) {
+    Chunk *chunk = rc->chunk;
+    uint8_t *code = chunk->code;
+    bool reachable = true;
+    for (rc->pc = 0; rc->pc < chunk->count;
+         rc->pc += instructionLength(chunk, rc->pc)) {
+        int pc = rc->pc;
+        if (rc->targets[pc]) {
+            if (!reachable) {
+                resetStack(rc, rc->depths[pc]);
+            } else if (rc->depth != rc->depths[pc]) {
+                return false;
+            } else {
+                flush(rc, rc->depth);
+            }
+            rc->offsets[pc] = rc->out->count;
+            rc->last = -1;
+        } else if (!reachable) {
+            resetStack(rc, rc->depths[pc]);
+        }
+        reachable = true;
+
+        uint8_t op = code[pc];
+        switch (op) {
+        case OP_CONSTANT:
+            push(rc, OPERAND_CONSTANT, code[pc + 1]);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitOp(rc, op == OP_NIL    ? OP_REG_NIL
+                       : op == OP_TRUE ? OP_REG_TRUE
+                                       : OP_REG_FALSE);
+            emitByte(rc, rc->depth);
+            push(rc, OPERAND_REGISTER, rc->depth);
+            break;
+        case OP_POP:
+            rc->depth--;
+            break;
+        case OP_GET_LOCAL:
+            rc->stack[rc->depth] = rc->stack[code[pc + 1]];
+            rc->depth++;
+            break;
+        case OP_SET_LOCAL:
+            setLocal(rc, code[pc + 1]);
+            break;
+        case OP_GET_GLOBAL:
+            emitOp(rc, OP_REG_GET_GLOBAL);
+            emitByte(rc, rc->depth);
+            emitByte(rc, code[pc + 1]);
+            emitByte(rc, code[pc + 2]);
+            push(rc, OPERAND_REGISTER, rc->depth);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int source = operandRegister(rc, rc->depth - 1);
+            emitOp(rc, op == OP_DEFINE_GLOBAL ? OP_REG_DEFINE_GLOBAL
+                                              : OP_REG_SET_GLOBAL);
+            emitByte(rc, source);
+            emitByte(rc, code[pc + 1]);
+            emitByte(rc, code[pc + 2]);
+            if (op == OP_DEFINE_GLOBAL) rc->depth--;
+            break;
+        }
+        case OP_GET_UPVALUE:
+            emitOp(rc, OP_REG_GET_UPVALUE);
+            emitByte(rc, rc->depth);
+            emitByte(rc, code[pc + 1]);
+            push(rc, OPERAND_REGISTER, rc->depth);
+            break;
+        case OP_SET_UPVALUE: {
+            int source = operandRegister(rc, rc->depth - 1);
+            emitOp(rc, OP_REG_SET_UPVALUE);
+            emitByte(rc, source);
+            emitByte(rc, code[pc + 1]);
+            break;
+        }
+        case OP_EQUAL: binaryOp(rc, OP_REG_EQUAL); break;
+        case OP_GREATER: binaryOp(rc, OP_REG_GREATER); break;
+        case OP_LESS: binaryOp(rc, OP_REG_LESS); break;
+        case OP_ADD: binaryOp(rc, OP_REG_ADD); break;
+        case OP_SUBTRACT: binaryOp(rc, OP_REG_SUBTRACT); break;
+        case OP_MULTIPLY: binaryOp(rc, OP_REG_MULTIPLY); break;
+        case OP_DIVIDE: binaryOp(rc, OP_REG_DIVIDE); break;
+        case OP_NOT: unaryOp(rc, OP_REG_NOT); break;
+        case OP_NEGATE: unaryOp(rc, OP_REG_NEGATE); break;
+        case OP_PRINT: {
+            int source = operandRegister(rc, rc->depth - 1);
+            emitOp(rc, OP_REG_PRINT);
+            emitByte(rc, source);
+            rc->depth--;
+            break;
+        }
+        case OP_JUMP:
+            flush(rc, rc->depth);
+            emitOp(rc, OP_REG_JUMP);
+            emitJump(rc, pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]));
+            reachable = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+            jumpIfFalse(rc, pc + 3 + ((code[pc + 1] << 8) | code[pc + 2]));
+            break;
+        case OP_LOOP: {
+            int target = pc + 3 - ((code[pc + 1] << 8) | code[pc + 2]);
+            flush(rc, rc->depth);
+            int offset = rc->out->count + 6 - rc->offsets[target];
+            if (offset > UINT16_MAX) return false;
+            emitOp(rc, OP_REG_LOOP);
+            emitShort(rc, offset);
+            emitShort(rc, target);
+            emitByte(rc, rc->depth);
+            reachable = false;
+            break;
+        }
+        case OP_CALL: {
+            int argCount = code[pc + 1];
+            flush(rc, rc->depth);
+            int callee = rc->depth - argCount - 1;
+            emitOp(rc, OP_REG_CALL);
+            emitByte(rc, callee);
+            emitByte(rc, argCount);
+            resetStack(rc, callee + 1);
+            break;
+        }
+        case OP_RETURN: {
+            int source = operandRegister(rc, rc->depth - 1);
+            emitOp(rc, OP_REG_RETURN);
+            emitByte(rc, source);
+            reachable = false;
+            break;
+        }
+        default:
+            embedStackInstruction(rc);
+            break;
+        }
+    }
+
+    for (int i = 0; i < rc->patchCount; i++) {
+        JumpPatch *patch = &rc->patches[i];
+        int jump = rc->offsets[patch->target] - (patch->offset + 2);
+        if (jump > UINT16_MAX) return false;
+        rc->out->code[patch->offset] = (jump >> 8) & 0xff;
+        rc->out->code[patch->offset + 1] = jump & 0xff;
+    }
+    return true;
+}
+
+void compileRegisterCode(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    RegisterCompiler rc;
+    rc.function = function;
+    rc.chunk = chunk;
+    rc.out = &function->registerCode;
+    rc.depths = malloc(sizeof(int) * (chunk->count + 1));
+    rc.targets = calloc(chunk->count + 1, sizeof(bool));
+    rc.offsets = malloc(sizeof(int) * (chunk->count + 1));
+    rc.depth = 0;
+    rc.last = -1;
+    rc.lastPc = 0;
+    rc.patches = NULL;
+    rc.patchCount = 0;
+    rc.patchCapacity = 0;
+    for (int pc = 0; pc <= chunk->count; pc++) {
+        rc.depths[pc] = -1;
+    }
+
+    bool translated = analyze(&rc);
+    if (translated) {
+        resetStack(&rc, function->arity + 1);
+        translated = translate(&rc);
+    }
+    if (!translated) {
+#ifdef OPEN_JIT
+        FREE_ARRAY(int, function->stackPcs, rc.out->capacity);
+        function->stackPcs = NULL;
+#endif
+        freeChunk(rc.out);
+    }
+
+    free(rc.depths);
+    free(rc.targets);
+    free(rc.offsets);
+    free(rc.patches);
+}
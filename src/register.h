@@ -0,0 +1,14 @@
+//
+// 寄存器字节码 由栈字节码翻译而来
+//
+
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "object.h"
+
+// 把函数的栈字节码翻译成寄存器字节码 写入function->registerCode
+// 栈深度超出一个字节的寄存器号或跳转偏移超出两个字节时放弃 函数仍执行栈字节码
+void compileRegisterCode(ObjFunction *function);
+
+#endif
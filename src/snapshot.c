@@ -0,0 +1,665 @@
+//
+// 字节码快照 格式按本机字节序 只在同一种机器上读写
+//
+// 文件头: "LOXC" 版本号 之后全部内容的校验和
+// 字符串段: 个数 每个字符串为长度和字符 之后都用下标引用字符串
+// 全局变量段: 个数 按全局变量下标排列的变量名 字节码里的下标要和读入时分配的一致
+// 函数: 函数名 参数数 提升值数 内联缓存数 字节码 按段压缩的行号 常量 常量中的函数递归写入
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "LOXC"
+#define SNAPSHOT_VERSION 2
+
+// 没有函数名 脚本函数
+#define SNAPSHOT_NO_NAME UINT32_MAX
+
+// 函数嵌套的最大深度 防止损坏的文件让读取递归过深
+#define SNAPSHOT_MAX_DEPTH 256
+
+// 常量的类型标记
+typedef enum {
+    CONSTANT_NUMBER,   // 8字节浮点数
+    CONSTANT_STRING,   // 字符串下标
+    CONSTANT_FUNCTION, // 嵌套函数
+} ConstantTag;
+
+// 写快照的状态
+typedef struct {
+    uint8_t *bytes;     // 文件头之后的内容 写完算出校验和再一起写入文件
+    size_t count;
+    size_t capacity;
+    Table indices;      // 字符串 -> 在字符串段中的下标
+    ValueArray strings; // 按下标排列的字符串
+    bool error;         // 遇到无法写入的常量
+} Writer;
+
+// 字符串的下标 第一次出现时加入字符串段
+static uint32_t stringIndex(Writer *writer, ObjString *string) {
+    Value index;
+    if (tableGet(&writer->indices, string, &index)) {
+        return (uint32_t)AS_NUMBER(index);
+    }
+    tableSet(&writer->indices, string, NUMBER_VAL(writer->strings.count));
+    writeValueArray(&writer->strings, OBJ_VAL(string));
+    return (uint32_t)(writer->strings.count - 1);
+}
+
+// 收集函数树中的字符串 写函数之前字符串段要先写完
+static void collectStrings(Writer *writer, ObjFunction *function) {
+    if (function->name != NULL) stringIndex(writer, function->name);
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value constant = constants->values[i];
+        if (IS_STRING(constant)) {
+            stringIndex(writer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            collectStrings(writer, AS_FUNCTION(constant));
+        }
+    }
+}
+
+static void writeBytes(Writer *writer, const void *bytes, size_t size) {
+    if (writer->capacity - writer->count < size) {
+        while (writer->capacity - writer->count < size) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL) exit(1);
+    }
+    memcpy(writer->bytes + writer->count, bytes, size);
+    writer->count += size;
+}
+
+static void writeU8(Writer *writer, uint8_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU32(Writer *writer, uint32_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeI32(Writer *writer, int value) {
+    int32_t i32 = value;
+    writeBytes(writer, &i32, sizeof(i32));
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    writeU32(writer, function->name != NULL
+                         ? stringIndex(writer, function->name)
+                         : SNAPSHOT_NO_NAME);
+    writeI32(writer, function->arity);
+    writeI32(writer, function->upvalueCount);
+    writeI32(writer, function->inlineCacheCount);
+
+    // 写融合前的指令 读入后按当前的编译目标重新翻译和融合
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    uint8_t *code = writer->bytes + (writer->count - chunk->count);
+    for (int pc = 0; pc < chunk->count; pc += instructionLength(chunk, pc)) {
+        code[pc] = baseOpcode(chunk->code[pc]);
+    }
+    // 行号按连续相同的段写入 每段为行号和字节数
+    int runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+    writeI32(writer, runs);
+    for (int i = 0; i < chunk->count;) {
+        int start = i;
+        while (i < chunk->count && chunk->lines[i] == chunk->lines[start]) i++;
+        writeI32(writer, chunk->lines[start]);
+        writeI32(writer, i - start);
+    }
+
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            writeU8(writer, CONSTANT_NUMBER);
+            writeBytes(writer, &number, sizeof(number));
+        } else if (IS_STRING(constant)) {
+            writeU8(writer, CONSTANT_STRING);
+            writeU32(writer, stringIndex(writer, AS_STRING(constant)));
+        } else if (IS_FUNCTION(constant)) {
+            writeU8(writer, CONSTANT_FUNCTION);
+            writeFunction(writer, AS_FUNCTION(constant));
+        } else {
+            // 编译器只生成以上三种常量
+            writer->error = true;
+        }
+    }
+}
+
+// FNV-1a 读入时发现文件被截断或改动
+static uint32_t checksum(const uint8_t *bytes, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool writeSnapshot(ObjFunction *function, const char *path) {
+    Writer writer;
+    writer.bytes = NULL;
+    writer.count = 0;
+    writer.capacity = 0;
+    initTable(&writer.indices);
+    initValueArray(&writer.strings);
+    writer.error = false;
+
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        stringIndex(&writer, AS_STRING(vm.globalNames.values[i]));
+    }
+    collectStrings(&writer, function);
+
+    writeU32(&writer, (uint32_t)writer.strings.count);
+    for (int i = 0; i < writer.strings.count; i++) {
+        ObjString *string = AS_STRING(writer.strings.values[i]);
+        writeU32(&writer, (uint32_t)string->length);
+        writeBytes(&writer, string->chars, string->length);
+    }
+
+    writeU32(&writer, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeU32(&writer,
+                 stringIndex(&writer, AS_STRING(vm.globalNames.values[i])));
+    }
+    writeFunction(&writer, function);
+
+    bool ok = !writer.error;
+    FILE *file = ok ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        uint32_t header[2] = {SNAPSHOT_VERSION,
+                              checksum(writer.bytes, writer.count)};
+        fwrite(SNAPSHOT_MAGIC, 1, 4, file);
+        fwrite(header, 1, sizeof(header), file);
+        fwrite(writer.bytes, 1, writer.count, file);
+        if (ferror(file)) ok = false;
+        if (fclose(file) != 0) ok = false;
+    } else {
+        ok = false;
+    }
+    free(writer.bytes);
+    freeTable(&writer.indices);
+    freeValueArray(&writer.strings);
+    return ok;
+}
+
+// 读快照的状态 出错后的读取都返回0 最后统一检查
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    bool error;
+} Reader;
+
+// 读入的字符串 读完前只有这里引用它们
+static ValueArray loadedStrings;
+
+// 取出接下来的size个字节 不够时出错返回NULL
+static const uint8_t *readBytes(Reader *reader, size_t size) {
+    if (reader->error || reader->size - reader->offset < size) {
+        reader->error = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->data + reader->offset;
+    reader->offset += size;
+    return bytes;
+}
+
+static uint8_t readU8(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static uint32_t readU32(Reader *reader) {
+    uint32_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// 读非负的32位整数
+static int readCount(Reader *reader) {
+    int32_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    if (value < 0) reader->error = true;
+    return value;
+}
+
+// 下标对应的字符串
+static ObjString *stringAt(Reader *reader, uint32_t index) {
+    if (reader->error || index >= (uint32_t)loadedStrings.count) {
+        reader->error = true;
+        return NULL;
+    }
+    return AS_STRING(loadedStrings.values[index]);
+}
+
+// 按下标引用的字符串
+static ObjString *readString(Reader *reader) {
+    return stringAt(reader, readU32(reader));
+}
+
+// 常量下标处是字符串 用作属性名、方法名和类名
+static bool isName(Chunk *chunk, int index) {
+    return index < chunk->constants.count &&
+           IS_STRING(chunk->constants.values[index]);
+}
+
+// 与栈深度无关的操作数 常量、提升值、全局变量和内联缓存的下标不能越界
+static bool checkOperands(ObjFunction *function, int offset,
+                          int inlineCacheCount) {
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+    case OP_CONSTANT:
+        return code[1] < chunk->constants.count;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+        return ((code[1] << 8) | code[2]) < vm.globalValues.count;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        return code[1] < function->upvalueCount;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return isName(chunk, code[1]) &&
+               ((code[2] << 8) | code[3]) < inlineCacheCount;
+    case OP_INVOKE:
+        return isName(chunk, code[1]) &&
+               ((code[3] << 8) | code[4]) < inlineCacheCount;
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+        return isName(chunk, code[1]);
+    case OP_CLOSURE: {
+        // 捕获外层提升值时下标不能超过外层的提升值数 局部变量槽位在推算栈深度时检查
+        ObjFunction *inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+        for (int i = 0; i < inner->upvalueCount; i++) {
+            uint8_t isLocal = code[2 + i * 2];
+            uint8_t index = code[3 + i * 2];
+            if (isLocal > 1) return false;
+            if (!isLocal && index >= function->upvalueCount) return false;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// 指令执行时从栈顶读取的值数
+static int stackInputs(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+    case OP_POP:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_JUMP_IF_FALSE:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+        return 1;
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_INHERIT:
+    case OP_METHOD:
+        return 2;
+    case OP_CALL:
+        return code[1] + 1;
+    case OP_INVOKE:
+        return code[2] + 1;
+    case OP_SUPER_INVOKE:
+        return code[2] + 2;
+    default:
+        return 0;
+    }
+}
+
+// 栈深度为depth时执行指令不会读到栈帧之外 局部变量槽位都在栈深度以内
+static bool checkStack(Chunk *chunk, int offset, int depth) {
+    uint8_t *code = chunk->code + offset;
+    if (depth < stackInputs(chunk, offset)) return false;
+    switch (code[0]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        return code[1] < depth;
+    case OP_CLOSURE: {
+        ObjFunction *inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+        for (int i = 0; i < inner->upvalueCount; i++) {
+            if (code[2 + i * 2] && code[3 + i * 2] >= depth) return false;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// 跳转指令的目标 其余指令返回-1
+static int jumpTarget(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return offset + 3 + ((code[1] << 8) | code[2]);
+    case OP_LOOP:
+        return offset + 3 - ((code[1] << 8) | code[2]);
+    default:
+        return -1;
+    }
+}
+
+// 控制流走到target时栈深度为depth 第一次走到时加入工作表 之后深度必须相同
+static bool mergeDepth(int *depths, int *worklist, int *pending, int count,
+                       int target, int depth) {
+    if (target < 0 || target >= count || depths[target] == -2) return false;
+    if (depths[target] == -1) {
+        depths[target] = depth;
+        worklist[(*pending)++] = target;
+        return true;
+    }
+    return depths[target] == depth;
+}
+
+// 检查读入的字节码 编译器生成的字节码总能通过 损坏的文件在这里拒绝
+// 之后的optimizeChunk、寄存器翻译、JIT和解释器都直接按操作数访问 不再检查
+static bool verifyCode(ObjFunction *function, int inlineCacheCount) {
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code;
+    int count = chunk->count;
+    if (function->arity > UINT8_MAX ||
+        function->upvalueCount > UINT8_COUNT || inlineCacheCount > count) {
+        return false;
+    }
+
+    // depths[pc]: 不是指令开头为-2 还没走到为-1 否则为执行前的栈深度
+    // linear[pc]: 按寄存器翻译的规则顺序推算的栈深度 不可达的代码也会被翻译
+    int *depths = malloc(sizeof(int) * count * 3);
+    if (depths == NULL) exit(1);
+    int *worklist = depths + count;
+    int *linear = depths + count * 2;
+    bool ok = true;
+
+    // 划分指令 只允许编译器直接生成的操作码 写入前融合和快速化指令都已还原
+    for (int pc = 0; pc < count; pc++) {
+        depths[pc] = -2;
+        linear[pc] = -1;
+    }
+    for (int pc = 0; pc < count && ok;) {
+        if (code[pc] >= OP_GET_LOCAL2) {
+            ok = false;
+            break;
+        }
+        // 闭包指令的长度取决于常量中的函数
+        if (code[pc] == OP_CLOSURE &&
+            (count - pc < 2 || code[pc + 1] >= chunk->constants.count ||
+             !IS_FUNCTION(chunk->constants.values[code[pc + 1]]))) {
+            ok = false;
+            break;
+        }
+        int length = instructionLength(chunk, pc);
+        if (length > count - pc) {
+            ok = false;
+            break;
+        }
+        depths[pc] = -1;
+        ok = checkOperands(function, pc, inlineCacheCount);
+        pc += length;
+    }
+
+    // 跳转目标都落在指令开头 不可达的跳转也会被optimizeChunk读取
+    for (int pc = 0; pc < count && ok; pc += instructionLength(chunk, pc)) {
+        if (code[pc] == OP_JUMP || code[pc] == OP_JUMP_IF_FALSE ||
+            code[pc] == OP_LOOP) {
+            int target = jumpTarget(chunk, pc);
+            ok = target >= 0 && target < count && depths[target] == -1;
+        }
+    }
+
+    // 沿控制流推算可达指令的栈深度 槽0为被调用的闭包 最后一条指令不能落出块尾
+    int pending = 0;
+    if (ok) ok = mergeDepth(depths, worklist, &pending, count, 0,
+                            function->arity + 1);
+    while (ok && pending > 0) {
+        int pc = worklist[--pending];
+        int depth = depths[pc];
+        if (!checkStack(chunk, pc, depth)) {
+            ok = false;
+            break;
+        }
+        int next = depth + stackEffect(chunk, pc);
+        int target = jumpTarget(chunk, pc);
+        switch (code[pc]) {
+        case OP_RETURN:
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            ok = mergeDepth(depths, worklist, &pending, count, target, next);
+            break;
+        case OP_JUMP_IF_FALSE:
+            ok = mergeDepth(depths, worklist, &pending, count, target, next) &&
+                 mergeDepth(depths, worklist, &pending, count,
+                            pc + instructionLength(chunk, pc), next);
+            break;
+        default:
+            ok = mergeDepth(depths, worklist, &pending, count,
+                            pc + instructionLength(chunk, pc), next);
+            break;
+        }
+    }
+
+    // 寄存器翻译按顺序推算深度 返回之后的死代码按语句结束时的深度继续 同样不能读到栈帧之外
+    int depth = function->arity + 1;
+    bool reachable = true;
+    for (int pc = 0; pc < count && ok; pc += instructionLength(chunk, pc)) {
+        if (!reachable && linear[pc] >= 0) depth = linear[pc];
+        linear[pc] = depth;
+        if ((code[pc] == OP_JUMP || code[pc] == OP_JUMP_IF_FALSE) &&
+            linear[jumpTarget(chunk, pc)] < 0) {
+            linear[jumpTarget(chunk, pc)] = depth;
+        }
+        ok = depth >= stackInputs(chunk, pc);
+        depth += code[pc] == OP_RETURN ? -1 : stackEffect(chunk, pc);
+        reachable = code[pc] != OP_JUMP && code[pc] != OP_LOOP &&
+                    code[pc] != OP_RETURN;
+    }
+
+    free(depths);
+    return ok;
+}
+
+// 读一个函数 返回时函数留在vm栈上 由调用方弹出
+static ObjFunction *readFunction(Reader *reader, int depth) {
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    if (depth > SNAPSHOT_MAX_DEPTH) {
+        reader->error = true;
+        return function;
+    }
+
+    uint32_t nameIndex = readU32(reader);
+    function->arity = readCount(reader);
+    function->upvalueCount = readCount(reader);
+    // 出错时函数会被回收 内联缓存数要和分配的一致 读完再设置
+    int inlineCacheCount = readCount(reader);
+    if (nameIndex != SNAPSHOT_NO_NAME) {
+        function->name = stringAt(reader, nameIndex);
+        if (function->name != NULL) {
+            writeBarrier((Obj *)function, OBJ_VAL(function->name));
+        }
+    }
+
+    int count = readCount(reader);
+    const uint8_t *code = readBytes(reader, count);
+    int runs = readCount(reader);
+    const uint8_t *lines = readBytes(reader, (size_t)runs * 2 * sizeof(int32_t));
+    // 编译器生成的函数至少有返回指令
+    if (count == 0) reader->error = true;
+    if (reader->error) return function;
+
+    Chunk *chunk = &function->chunk;
+    uint8_t *chunkCode = ALLOCATE(uint8_t, count);
+    int *chunkLines = ALLOCATE(int, count);
+    memcpy(chunkCode, code, count);
+    int filled = 0;
+    for (int i = 0; i < runs; i++) {
+        int32_t run[2];
+        memcpy(run, lines + i * sizeof(run), sizeof(run));
+        if (run[1] < 0 || run[1] > count - filled) {
+            reader->error = true;
+            break;
+        }
+        for (int j = 0; j < run[1]; j++) chunkLines[filled++] = run[0];
+    }
+    if (filled != count) reader->error = true;
+    chunk->code = chunkCode;
+    chunk->lines = chunkLines;
+    chunk->count = count;
+    chunk->capacity = count;
+    if (reader->error) return function;
+
+    int constantCount = readCount(reader);
+    for (int i = 0; i < constantCount && !reader->error; i++) {
+        Value constant;
+        switch (readU8(reader)) {
+            case CONSTANT_NUMBER: {
+                double number = 0;
+                const uint8_t *bytes = readBytes(reader, sizeof(number));
+                if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+                constant = NUMBER_VAL(number);
+                // 值的表示里数字和其他类型共用位模式 只接受真正的数字
+                if (!IS_NUMBER(constant)) reader->error = true;
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString *string = readString(reader);
+                if (string == NULL) return function;
+                constant = OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction *inner = readFunction(reader, depth + 1);
+                constant = OBJ_VAL(inner);
+                if (!reader->error) {
+                    addConstant(chunk, constant);
+                    writeBarrier((Obj *)function, constant);
+                }
+                pop();
+                continue;
+            }
+            default:
+                reader->error = true;
+                return function;
+        }
+        addConstant(chunk, constant);
+        writeBarrier((Obj *)function, constant);
+    }
+    if (reader->error) return function;
+    // 脚本函数由解释器直接包成闭包 没有参数和提升值
+    if ((depth == 0 && (function->arity != 0 || function->upvalueCount != 0)) ||
+        !verifyCode(function, inlineCacheCount)) {
+        reader->error = true;
+        return function;
+    }
+
+    function->inlineCacheCount = inlineCacheCount;
+    finishFunction(function, true);
+    return function;
+}
+
+ObjFunction *readSnapshot(const uint8_t *data, size_t size) {
+    Reader reader = {data, size, 0, false};
+    const uint8_t *magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        readU32(&reader) != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Not a snapshot for this version of lox.\n");
+        return NULL;
+    }
+    uint32_t expected = readU32(&reader);
+    if (reader.error ||
+        expected != checksum(data + reader.offset, size - reader.offset)) {
+        fprintf(stderr, "Corrupt snapshot.\n");
+        return NULL;
+    }
+
+    // 字符串集中驻留 先给字符串表留够空间 避免逐个插入时反复扩容
+    initValueArray(&loadedStrings);
+    int stringCount = readCount(&reader);
+    if (!reader.error && (size_t)stringCount <= size / sizeof(uint32_t)) {
+        tableReserve(&vm.strings, stringCount);
+    }
+    for (int i = 0; i < stringCount && !reader.error; i++) {
+        int length = readCount(&reader);
+        const uint8_t *chars = readBytes(&reader, length);
+        if (chars == NULL) break;
+        ObjString *string = copyString((const char *)chars, length);
+        push(OBJ_VAL(string));
+        writeValueArray(&loadedStrings, OBJ_VAL(string));
+        pop();
+    }
+
+    // 字节码按下标访问全局变量 读入时分配到的下标必须和写入时相同
+    int globalCount = readCount(&reader);
+    bool globalsMatch = true;
+    for (int i = 0; i < globalCount && !reader.error; i++) {
+        ObjString *name = readString(&reader);
+        if (name != NULL && globalSlot(name) != i) {
+            globalsMatch = false;
+            break;
+        }
+    }
+
+    ObjFunction *function = NULL;
+    if (!reader.error && globalsMatch) {
+        function = readFunction(&reader, 0);
+        pop();
+        if (reader.offset != reader.size) reader.error = true;
+    }
+    freeValueArray(&loadedStrings);
+
+    if (!globalsMatch) {
+        fprintf(stderr, "Snapshot globals do not match this interpreter.\n");
+        return NULL;
+    }
+    if (reader.error) {
+        fprintf(stderr, "Corrupt snapshot.\n");
+        return NULL;
+    }
+    return function;
+}
+
+void markSnapshotRoots() {
+    for (int i = 0; i < loadedStrings.count; i++) {
+        markValue(loadedStrings.values[i]);
+    }
+}
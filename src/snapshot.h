@@ -0,0 +1,20 @@
+//
+// 字节码快照 把编译好的函数树写进.loxc文件 启动时直接读入 不再扫描和编译源码
+//
+
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "object.h"
+
+// 把脚本函数和它引用的全局变量名写入path 调用方要保证function可达
+bool writeSnapshot(ObjFunction *function, const char *path);
+
+// 从内存中的快照读出脚本函数 只顺序读取data 可以直接传入mmap的文件
+// 格式不对或全局变量和当前虚拟机对不上时打印错误并返回NULL
+ObjFunction *readSnapshot(const uint8_t *data, size_t size);
+
+// 标记读入快照期间的根对象
+void markSnapshotRoots();
+
+#endif
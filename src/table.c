@@ -4,6 +4,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
@@ -11,150 +14,283 @@
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+// 元素数低于这个比例时缩容
+#define TABLE_MIN_LOAD 0.125
+
+// 控制字节 最高位为1的是空槽或墓碑 为0的低7位是key哈希的低7位
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// 组内匹配结果 第i位为1表示第i个槽匹配
+typedef uint32_t GroupMask;
+
+// 组内控制字节等于byte的槽
+static inline GroupMask matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// 组内的空槽和墓碑 即控制字节最高位为1的槽
+static inline GroupMask matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(control);
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// 哈希低7位存进控制字节 其余位选择起始组
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+// 依次探测的组 第i次跳过i个组 组数是2的幂时能走遍所有组
+#define NEXT_GROUP(group, step, mask) (((group) + (step)) & (mask))
 
 void initTable(Table *table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table *table) {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-// 根据hash取模查找节点
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
-    // 遍历直到找到空节点或者key对象本身
-    for (;;) {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // 空节点 此时如果之前找到墓碑节点应该使用墓碑节点
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // 发现墓碑节点
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // 目标节点
-            return entry;
+// 查找key所在的槽 不存在返回-1
+static int findSlot(Table *table, ObjString *key) {
+    uint32_t mask = table->capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(key->hash) & mask;
+    uint8_t tag = HASH_TAG(key->hash);
+    for (uint32_t step = 1;; step++) {
+        const uint8_t *control = table->control + group * TABLE_GROUP_WIDTH;
+        GroupMask match = matchByte(control, tag);
+        while (match != 0) {
+            int slot = group * TABLE_GROUP_WIDTH + __builtin_ctz(match);
+            if (table->entries[slot].key == key) return slot;
+            match &= match - 1;
         }
+        // 组里有空槽 说明key插入时不会越过这一组
+        if (matchByte(control, CONTROL_EMPTY) != 0) return -1;
+        group = NEXT_GROUP(group, step, mask);
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// 新key可以放的槽 探测路径上第一个空槽或墓碑
+static int findFreeSlot(uint8_t *controls, int capacity, uint32_t hash) {
+    uint32_t mask = capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(hash) & mask;
+    for (uint32_t step = 1;; step++) {
+        GroupMask free = matchFree(controls + group * TABLE_GROUP_WIDTH);
+        if (free != 0) return group * TABLE_GROUP_WIDTH + __builtin_ctz(free);
+        group = NEXT_GROUP(group, step, mask);
     }
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 // 哈希表扩容
 static void adjustCapacity(Table *table, int capacity) {
+    uint8_t *control = ALLOCATE(uint8_t, capacity);
     Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    memset(control, CONTROL_EMPTY, capacity);
 
-    // 表容量为0 墓碑节点为逻辑删除  不会复制过来
-    table->count = 0;
+    // 墓碑节点为逻辑删除  不会复制过来
     // 旧表的键值对 插入到新表 然后释放旧表
     for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (table->control[i] & 0x80) continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry *entry = &table->entries[i];
+        int slot = findFreeSlot(control, capacity, entry->key->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
     }
+    table->tombstones = 0;
 
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
 
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-    // 节点数组当前容量是否大于负载因子*容量
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    int slot = table->count > 0 ? findSlot(table, key) : -1;
+    if (slot >= 0) {
+        table->entries[slot].value = value;
+        return false;
+    }
+
+    // 元素和墓碑超过负载因子*容量 墓碑占多数时按原容量重建 否则扩容
+    if (table->count + table->tombstones + 1 >
+        table->capacity * TABLE_MAX_LOAD) {
+        int capacity = table->tombstones > table->count ? table->capacity
+                       : table->capacity < TABLE_GROUP_WIDTH
+                           ? TABLE_GROUP_WIDTH
+                           : table->capacity * 2;
         adjustCapacity(table, capacity);
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    // 由于墓碑节点是逻辑删除  所以只有空节点新增长度
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    slot = findFreeSlot(table->control, table->capacity, key->hash);
+    // 复用墓碑
+    if (table->control[slot] == CONTROL_DELETED) table->tombstones--;
+    table->count++;
+
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    return true;
+}
+
+// 删除槽中的key 组里还有空槽时直接置空 否则留下墓碑
+// 组一旦被填满就不会再出现空槽 有空槽的组没有被越过 置空不会截断其他key的探测
+static void deleteSlot(Table *table, int slot) {
+    uint8_t *group = table->control + slot / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+    if (matchByte(group, CONTROL_EMPTY) != 0) {
+        table->control[slot] = CONTROL_EMPTY;
+    } else {
+        table->control[slot] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    table->count--;
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+// 删除后整理 元素很少时容量减半 墓碑比元素多时按原容量重建
+// 每次只减半 字符串表在两次回收之间还会长回去 一次缩到底会反复扩容
+static void compactTable(Table *table) {
+    if (table->capacity > TABLE_GROUP_WIDTH &&
+        table->count < table->capacity * TABLE_MIN_LOAD) {
+        adjustCapacity(table, table->capacity / 2);
+    } else if (table->tombstones > table->count) {
+        adjustCapacity(table, table->capacity);
+    }
 }
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
 
     // Find the entry.
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    // value 置为 true作墓碑节点  逻辑删除count
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, slot);
+    compactTable(table);
     return true;
 }
 
 void tableAddAll(Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
+        if (from->control[i] & 0x80) continue;
         Entry *entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
-        }
+        tableSet(to, entry->key, entry->value);
+    }
+}
+
+void tableReserve(Table *table, int count) {
+    int needed = table->count + table->tombstones + count;
+    if (needed <= table->capacity * TABLE_MAX_LOAD) return;
+
+    int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH
+                                                       : table->capacity;
+    while (needed > capacity * TABLE_MAX_LOAD) capacity *= 2;
+    adjustCapacity(table, capacity);
+}
+
+// 两段长度为length的字符是否相同
+// 不超过16字节时用首尾两次重叠的读取比较 不调用memcmp 也不会读出界
+static inline bool charsEqual(const char *a, const char *b, int length) {
+    if (length >= 8) {
+        if (length > 16) return memcmp(a, b, length) == 0;
+        uint64_t a0, a1, b0, b1;
+        memcpy(&a0, a, 8);
+        memcpy(&b0, b, 8);
+        memcpy(&a1, a + length - 8, 8);
+        memcpy(&b1, b + length - 8, 8);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+    }
+    if (length >= 4) {
+        uint32_t a0, a1, b0, b1;
+        memcpy(&a0, a, 4);
+        memcpy(&b0, b, 4);
+        memcpy(&a1, a + length - 4, 4);
+        memcpy(&b1, b + length - 4, 4);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+    }
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
     }
+    return true;
 }
 
 ObjString *tableFindString(Table *table, const char *chars,int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // 找到为空且不是墓碑节点的  说明不存在
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // 找到对应节点
-            return entry->key;
+    uint32_t mask = table->capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(hash) & mask;
+    uint8_t tag = HASH_TAG(hash);
+    for (uint32_t step = 1;; step++) {
+        const uint8_t *control = table->control + group * TABLE_GROUP_WIDTH;
+        GroupMask match = matchByte(control, tag);
+        while (match != 0) {
+            ObjString *key =
+                table->entries[group * TABLE_GROUP_WIDTH + __builtin_ctz(match)].key;
+            if (key->hash == hash && key->length == length &&
+                charsEqual(key->chars, chars, length)) {
+                // 找到对应节点
+                return key;
+            }
+            match &= match - 1;
         }
-
-        index = (index + 1) & (table->capacity - 1);
+        // 找到为空且不是墓碑节点的  说明不存在
+        if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
+        group = NEXT_GROUP(group, step, mask);
     }
 }
 
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (table->control[i] & 0x80) continue;
+        if (!table->entries[i].key->obj.isMarked) {
+            deleteSlot(table, i);
         }
     }
+    // 字符串表每次回收后都会删掉一批 在这里整理 探测长度不会越用越长
+    compactTable(table);
 }
 
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
         Entry* entry = &table->entries[i];
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 //
 // Created by Administrator on 2022/7/22.
 // 开放寻址法 哈希算法为 hashString 逻辑删除
+// Swiss table布局: 每个槽有一个控制字节 按16个槽一组探测 组内用SSE2一次比较
 //
 
 #ifndef clox_table_h
@@ -15,11 +16,16 @@ typedef struct {
     Value value;    // 值对象可以是任意元素
 } Entry;
 
+// 一组的槽数 也是容量的最小值
+#define TABLE_GROUP_WIDTH 16
+
 // 哈希表
 typedef struct {
-    int count;      // 当前元素数
-    int capacity;   // 最大元素数
-    Entry *entries; // 哈希节点数组
+    int count;        // 当前元素数
+    int tombstones;   // 墓碑数 和元素数一起计入负载
+    int capacity;     // 槽数 为0或TABLE_GROUP_WIDTH乘2的幂
+    uint8_t *control; // 控制字节 空槽、墓碑或key哈希的低7位
+    Entry *entries;   // 哈希节点数组 与控制字节一一对应
 } Table;
 
 // 初始化表
@@ -40,6 +46,9 @@ bool tableDelete(Table *table, ObjString *key);
 // 复制表
 void tableAddAll(Table *from, Table *to);
 
+// 预留空间 再插入count个键不会扩容
+void tableReserve(Table *table, int count);
+
 // 在表中寻找字符串节点
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
@@ -66,7 +66,9 @@ bool valuesEqual(Value a, Value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) return true;
+    // 驻留的字符串按地址比较 拼接结果要比较内容
+    return IS_OBJ(a) && IS_OBJ(b) && stringsEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -77,7 +79,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: {
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
         }
         default:
             return false; // Unreachable.
@@ -22,6 +22,8 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+// 未定义的全局变量 只出现在全局变量数组里 不会作为值出现
+#define TAG_UNDEFINED 4 // 100.
 
 typedef uint64_t Value;
 
@@ -29,6 +31,7 @@ typedef uint64_t Value;
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    valueToNum(value)
@@ -38,6 +41,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -61,7 +65,8 @@ typedef enum {
     VAL_BOOL,   // 布尔类型
     VAL_NIL,    // 空类型
     VAL_NUMBER, // 数字类型
-    VAL_OBJ     // 对象类型
+    VAL_OBJ,    // 对象类型
+    VAL_UNDEFINED // 未定义的全局变量 只出现在全局变量数组里
 } ValueType;
 
 // 基础值
@@ -82,6 +87,8 @@ typedef struct {
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 // 判断值是否为对象
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+// 判断全局变量是否未定义
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 // 值类型转化c的obj
 #define AS_OBJ(value)     ((value).as.obj)
@@ -99,6 +106,8 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 // 定义值对象类型
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+// 未定义的全局变量
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
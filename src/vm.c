@@ -15,8 +15,16 @@
 #endif
 #include "memory.h"
 #include "object.h"
+#include "snapshot.h"
 #include "vm.h"
 
+// GCC/Clang支持标签地址 解释器用直接线程分派 定义SWITCH_DISPATCH时退回switch
+#if !defined(SWITCH_DISPATCH) && defined(__GNUC__)
+#define DIRECT_THREADED_DISPATCH 1
+#else
+#define DIRECT_THREADED_DISPATCH 0
+#endif
+
 VM vm;
 
 // 时钟原生函数
@@ -31,6 +39,14 @@ static void resetStack() {
     vm.openUpvalues = NULL;
 }
 
+Chunk *frameChunk(CallFrame *frame) {
+    Chunk *chunk = &frame->closure->function->registerCode;
+    if (frame->ip > chunk->code && frame->ip <= chunk->code + chunk->count) {
+        return chunk;
+    }
+    return &frame->closure->function->chunk;
+}
+
 // 运行时异常
 void runtimeError(const char *format, ...) {
     va_list args;
@@ -42,8 +58,9 @@ void runtimeError(const char *format, ...) {
     for (int i = vm.frameCount - 1; i >= 0; i--) {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        Chunk *chunk = frameChunk(frame);
+        size_t instruction = frame->ip - chunk->code - 1;
+        fprintf(stderr, "[line %d] in ", chunk->lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -57,7 +74,8 @@ void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -65,38 +83,60 @@ static void defineNative(const char *name, NativeFn function) {
 void initVM() {
     resetStack();
     vm.objects = NULL;
+    vm.youngObjects = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.nextYoungGC = GC_NURSERY_SIZE;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.rememberedSet = NULL;
+    vm.gcIncremental = false;
+    vm.gcPhase = GC_IDLE;
+    vm.gcPause = GC_DEFAULT_PAUSE;
+    vm.nextGCStep = vm.nextGC;
+    vm.sweepObjects = NULL;
+    vm.sweepYoung = NULL;
+    vm.gcThreads = 1;
+    vm.gcReport = false;
+    memset(&vm.gcStats, 0, sizeof(GCStats));
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    initTable(&vm.globalSlots);
     initTable(&vm.strings);
 
+    vm.registerTarget = false;
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    vm.rootShape = NULL;
+    vm.rootShape = newShape(NULL, NULL);
 
 #ifdef OPEN_JIT
-    vm.mirContext = _MIR_init();
-    memset(&vm.mirOptions, 0, sizeof(struct c2mir_options));
-    vm.mirOptions.message_file = stderr;
-    vm.mirOptions.module_num = 0;
+    vm.jitThreshold = JIT_THRESHOLD;
+    vm.jitReport = false;
+    initJit(&vm);
 #endif
 
     defineNative("clock", clockNative);
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+#ifdef OPEN_JIT
+    // 先停下后台编译线程 它还在读取函数对象
+    freeJit(&vm);
+#endif
+
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    freeTable(&vm.globalSlots);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.rootShape = NULL;
     freeObjects();
-
-#ifdef OPEN_JIT
-    MIR_finish(vm.mirContext);
-#endif
 }
 
 void push(Value value) {
@@ -112,6 +152,17 @@ Value pop() {
 // 查看栈中的值但是不弹出 peek(0)为栈顶
 Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+#ifdef OPEN_JIT
+// 记录一次调用 调用次数加回边次数达到阈值时函数变热
+static bool isHot(ObjFunction *function) {
+    if (vm.jitThreshold < 0) {
+        return false;
+    }
+    function->callCount++;
+    return function->callCount + function->loopCount >= vm.jitThreshold;
+}
+#endif
+
 // 执行
 static bool call(ObjClosure *closure, int argCount) {
     if (argCount != closure->function->arity) {
@@ -126,19 +177,24 @@ static bool call(ObjClosure *closure, int argCount) {
     }
 
 #ifdef OPEN_JIT
-    if (closure->jitFunction != NULL) {
-        return !closure->jitFunction(&vm, closure);
-    } else {
-        jitCompile(&vm, closure, argCount);
-        return !closure->jitFunction(&vm, closure);
+    ObjFunction *function = closure->function;
+    if (function->jitFunction == NULL && isHot(function)) {
+        jitCompile(&vm, function);
+        if (function->jitFunction == NULL) {
+            return false;
+        }
     }
-#else
+    if (function->jitFunction != NULL) {
+        // 退优化时栈帧还在 调用者会接着解释执行
+        return function->jitFunction(&vm, closure) != INTERPRET_RUNTIME_ERROR;
+    }
+#endif
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = entryCode(closure->function);
     frame->slots = vm.stackTop - argCount - 1;
     return true;
-#endif
 }
 
 // 调用 值类型  仅接受 函数 类 方法
@@ -189,8 +245,60 @@ bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
     return call(AS_CLOSURE(method), argCount);
 }
 
+// 在缓存中找接收者形状对应的项 方法项还要求类相同
+// 形状相同的实例字段下标相同 方法项命中说明实例没有同名字段
+static inline InlineCacheEntry *probeCache(InlineCache *cache,
+                                           ObjInstance *instance) {
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->shape == NULL) break;
+        if (entry->shape == instance->shape &&
+            (entry->index >= 0 || entry->klass == instance->klass)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// 记录查找结果 同一形状的同类项直接覆盖 缓存满后不再记录
+static void updateCache(InlineCache *cache, ObjShape *shape,
+                        ObjShape *transition, ObjClass *klass,
+                        ObjClosure *method, int index) {
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->shape == NULL ||
+            (entry->shape == shape && (entry->index < 0) == (index < 0) &&
+             (entry->transition == NULL) == (transition == NULL))) {
+            entry->shape = shape;
+            entry->transition = transition;
+            entry->klass = klass;
+            entry->method = method;
+            entry->index = index;
+            // 不知道缓存属于哪个函数 缓存的对象直接晋升
+            promoteObject((Obj *)shape);
+            promoteObject((Obj *)transition);
+            promoteObject((Obj *)klass);
+            promoteObject((Obj *)method);
+            return;
+        }
+    }
+}
+
+// 查找类的方法 实例没有同名字段时才会走到这里 结果记入缓存
+static ObjClosure *lookupMethod(InlineCache *cache, ObjInstance *instance,
+                                ObjString *name) {
+    Value value;
+    if (!tableGet(&instance->klass->methods, name, &value)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return NULL;
+    }
+    updateCache(cache, instance->shape, NULL, instance->klass,
+                AS_CLOSURE(value), -1);
+    return AS_CLOSURE(value);
+}
+
 // 执行方法
-bool invoke(ObjString *name, int argCount) {
+bool invoke(ObjString *name, int argCount, InlineCache *cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -199,14 +307,94 @@ bool invoke(ObjString *name, int argCount) {
     }
 
     ObjInstance *instance = AS_INSTANCE(receiver);
+    InlineCacheEntry *entry = probeCache(cache, instance);
+    int index;
+    if (entry != NULL) {
+        if (entry->index < 0) {
+            return call(entry->method, argCount);
+        }
+        index = entry->index;
+    } else {
+        index = shapeFindField(instance->shape, name);
+        if (index >= 0) {
+            updateCache(cache, instance->shape, NULL, NULL, NULL, index);
+        }
+    }
 
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (index >= 0) {
+        Value value = instance->fields[index];
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    ObjClosure *method = lookupMethod(cache, instance, name);
+    return method != NULL && call(method, argCount);
+}
+
+// 获取属性 先找字段再找方法
+bool getProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    InlineCacheEntry *entry = probeCache(cache, instance);
+    ObjClosure *method;
+    if (entry != NULL && entry->index >= 0) {
+        vm.stackTop[-1] = instance->fields[entry->index];
+        return true;
+    } else if (entry != NULL) {
+        method = entry->method;
+    } else {
+        int index = shapeFindField(instance->shape, name);
+        if (index >= 0) {
+            updateCache(cache, instance->shape, NULL, NULL, NULL, index);
+            vm.stackTop[-1] = instance->fields[index];
+            return true;
+        }
+        method = lookupMethod(cache, instance, name);
+        if (method == NULL) return false;
+    }
+
+    ObjBoundMethod *bound = newBoundMethod(peek(0), method);
+    pop();
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+// 赋值属性 已有字段直接改写 否则实例转到加入字段后的形状
+bool setProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    InlineCacheEntry *entry = probeCache(cache, instance);
+    if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->index] = peek(0);
+        writeBarrier((Obj *)instance, peek(0));
+    } else if (entry != NULL) {
+        instanceAddField(instance, entry->transition, peek(0));
+    } else {
+        ObjShape *shape = instance->shape;
+        int index = shapeFindField(shape, name);
+        if (index >= 0) {
+            instance->fields[index] = peek(0);
+            writeBarrier((Obj *)instance, peek(0));
+            updateCache(cache, shape, NULL, NULL, NULL, index);
+        } else {
+            ObjShape *transition = shapeTransition(shape, name);
+            instanceAddField(instance, transition, peek(0));
+            updateCache(cache, shape, transition, NULL, NULL,
+                        transition->fieldCount - 1);
+        }
+    }
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
 }
 
 // 绑定方法给实例
@@ -249,12 +437,29 @@ ObjUpvalue *captureUpvalue(Value *local) {
     return createdUpvalue;
 }
 
+// 名字先压栈 扩容时可能触发GC
+int globalSlot(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    int index = vm.globalValues.count - 1;
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
 // 关闭提升值
 void closeUpvalues(Value *last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -264,6 +469,7 @@ void defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    rememberObject((Obj *)klass);
     pop();
 }
 
@@ -272,319 +478,939 @@ bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-// 连接字符串
+// 连接字符串 短的结果照旧驻留 长的结果放进拼接缓冲区
+// 左边是缓冲区末尾时原地追加 循环里反复拼接只复制新增的部分
 void concatenate() {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
+    Value b = peek(0);
+    Value a = peek(1);
+    int length = stringLength(a) + stringLength(b);
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    if (length < CONCAT_MIN_LENGTH) {
+        // 短结果在栈上拼好 驻留时只分配字符串对象
+        char chars[CONCAT_MIN_LENGTH];
+        memcpy(chars, stringChars(a), stringLength(a));
+        memcpy(chars + stringLength(a), stringChars(b), stringLength(b));
 
-    ObjString *result = takeString(chars, length);
+        ObjString *result = copyString(chars, length);
+        pop();
+        pop();
+        push(OBJ_VAL(result));
+        return;
+    }
+
+    ObjBuffer *buffer;
+    if (IS_CONCAT(a) && AS_CONCAT(a)->length == AS_CONCAT(a)->buffer->length) {
+        // 扩容期间a和b还在栈上 缓冲区可达
+        buffer = AS_CONCAT(a)->buffer;
+        if (length > buffer->capacity) {
+            int capacity = buffer->capacity;
+            while (capacity < length) capacity = GROW_CAPACITY(capacity);
+            buffer->chars = GROW_ARRAY(char, buffer->chars, buffer->capacity,
+                                       capacity);
+            buffer->capacity = capacity;
+        }
+    } else {
+        buffer = newBuffer(GROW_CAPACITY(length));
+        memcpy(buffer->chars, stringChars(a), stringLength(a));
+    }
+    push(OBJ_VAL(buffer));
+    // b可能和a共用缓冲区 扩容后再取字符
+    memcpy(buffer->chars + stringLength(a), stringChars(b), stringLength(b));
+    buffer->length = length;
 
+    ObjConcat *result = newConcat(buffer, length);
+    pop();
     pop();
     pop();
-
     push(OBJ_VAL(result));
 }
 
 // 虚拟机运行时
+// 执行到进入时的栈帧返回为止 JIT代码调用冷函数时会重入
 static InterpretResult run() {
     // 拿到vm中的栈帧
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    int baseFrameCount = vm.frameCount - 1;
+    // 当前帧的ip、局部变量和栈顶放在局部变量里 调用运行时函数前写回vm
+    uint8_t *ip = frame->ip;
+    Value *slots = frame->slots;
+    Value *stackTop = vm.stackTop;
 
 // 读取字节码块单个字节
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 // 读取常量，在读取单个字节后再读取单个字节的值为常量数组的索引
-#define READ_SHORT()                                                           \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 // 读取常量，在读取单个字节后再读取单个字节的值为常量数组的索引
 #define READ_CONSTANT()                                                        \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 // 读取常量后 转化为值字符串
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+// 读取两字节的内联缓存编号
+#define READ_CACHE() (&frame->closure->function->inlineCaches[READ_SHORT()])
+// 局部栈顶上的压栈、弹栈和查看
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+// 调用运行时函数前写回ip和栈顶 运行时函数会读写vm栈、触发GC或报错
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = stackTop)
+// 运行时函数可能改变了栈顶
+#define LOAD_STACK() (stackTop = vm.stackTop)
+// 调用或返回后切换到最上层的栈帧
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &vm.frames[vm.frameCount - 1];                                 \
+        ip = frame->ip;                                                        \
+        slots = frame->slots;                                                  \
+        stackTop = vm.stackTop;                                                \
+    } while (false)
+#ifdef OPEN_JIT
+// 记录当前算术指令的操作数类型 JIT据此推测
+#define PROFILE_TYPES(isNumber)                                                \
+    (frame->closure->function                                                  \
+         ->typeProfile[ip - 1 - frame->closure->function->chunk.code] |=       \
+     (isNumber) ? TYPE_PROFILE_NUMBER : TYPE_PROFILE_OTHER)
+// 超级指令跳过了被融合的算术指令 按它的位置记录
+#define PROFILE_NUMBER_AT(instruction)                                         \
+    (frame->closure->function                                                  \
+         ->typeProfile[(instruction) - frame->closure->function->chunk.code] |= \
+     TYPE_PROFILE_NUMBER)
+// 寄存器指令按翻译前的栈指令记录
+#define PROFILE_REGISTER(isNumber)                                             \
+    (frame->closure->function->typeProfile                                     \
+         [frame->closure->function->stackPcs                                   \
+              [ip - 1 - frame->closure->function->registerCode.code]] |=       \
+     (isNumber) ? TYPE_PROFILE_NUMBER : TYPE_PROFILE_OTHER)
+#else
+#define PROFILE_TYPES(isNumber) ((void)0)
+#define PROFILE_NUMBER_AT(instruction) ((void)0)
+#define PROFILE_REGISTER(isNumber) ((void)0)
+#endif
+// 寄存器指令的操作数 ip指向第一个操作数
+#define REGISTER(n) (slots[ip[(n)]])
+#define REGISTER_CONSTANT(n)                                                   \
+    (frame->closure->function->chunk.constants.values[ip[(n)]])
+#define REGISTER_SHORT(n) ((uint16_t)((ip[(n)] << 8) | ip[(n) + 1]))
+// 寄存器二元运算 r[A] = r[B] op right
+#define REGISTER_BINARY_OP(valueType, op, right, message)                      \
+    do {                                                                       \
+        Value a = REGISTER(1);                                                 \
+        Value b = (right);                                                     \
+        bool numbers = IS_NUMBER(a) && IS_NUMBER(b);                           \
+        PROFILE_REGISTER(numbers);                                             \
+        if (!numbers) {                                                        \
+            STORE_FRAME();                                                     \
+            runtimeError(message);                                             \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        REGISTER(0) = valueType(AS_NUMBER(a) op AS_NUMBER(b));                 \
+        ip += 3;                                                               \
+    } while (false)
+// 比较不成立时跳转 right为右操作数 ip += 2后指向跳转偏移
+#define REGISTER_COMPARE_JUMP(op, right)                                       \
+    do {                                                                       \
+        Value a = REGISTER(0);                                                 \
+        Value b = (right);                                                     \
+        bool numbers = IS_NUMBER(a) && IS_NUMBER(b);                           \
+        PROFILE_REGISTER(numbers);                                             \
+        if (!numbers) {                                                        \
+            STORE_FRAME();                                                     \
+            runtimeError("Operands must be numbers.");                         \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        if (AS_NUMBER(a) op AS_NUMBER(b)) {                                    \
+            ip += 4;                                                           \
+        } else {                                                               \
+            ip += 4 + REGISTER_SHORT(2);                                       \
+        }                                                                      \
+    } while (false)
 // 模拟二元运算
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                      \
+        bool numbers = IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1));               \
+        PROFILE_TYPES(numbers);                                                \
+        if (!numbers) {                                                        \
+            STORE_FRAME();                                                     \
             runtimeError("Operands must be numbers.");                         \
             return INTERPRET_RUNTIME_ERROR;                                    \
         }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
+        double b = AS_NUMBER(POP());                                           \
+        double a = AS_NUMBER(POP());                                           \
+        PUSH(valueType(a op b));                                               \
     } while (false)
-
-    for (;;) {
 // debug 轨迹 执行
 #ifdef DEBUG_TRACE_EXECUTION
-        // 打印虚拟机栈的内容
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        // 反汇编
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION()                                                      \
+    do {                                                                       \
+        /* 打印虚拟机栈的内容 */                                               \
+        printf("          ");                                                  \
+        for (Value *slot = vm.stack; slot < stackTop; slot++) {                \
+            printf("[ ");                                                      \
+            printValue(*slot);                                                 \
+            printf(" ]");                                                      \
+        }                                                                      \
+        printf("\n");                                                          \
+        /* 反汇编 */                                                           \
+        Chunk *registerCode = &frame->closure->function->registerCode;         \
+        if (ip >= registerCode->code &&                                        \
+            ip < registerCode->code + registerCode->count) {                   \
+            disassembleRegisterInstruction(frame->closure->function,           \
+                                           (int)(ip - registerCode->code));    \
+        } else {                                                               \
+            disassembleInstruction(                                            \
+                &frame->closure->function->chunk,                              \
+                (int)(ip - frame->closure->function->chunk.code));             \
+        }                                                                      \
+    } while (false)
+#else
+#define TRACE_EXECUTION() ((void)0)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-        case OP_CONSTANT: {
+// 指令分派 直接线程分派时每条指令末尾各自跳到下一条指令的标签
+// 间接跳转分散在各处 分支预测器能按前一条指令区分
+// 超级指令和快速化指令的快路径不适用时 跳到原指令的标签执行原指令
+#define CASE(op) case op: label_##op
+#define FALLBACK(op) goto label_##op
+#if DIRECT_THREADED_DISPATCH
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        TRACE_EXECUTION();                                                     \
+        goto *dispatchTable[READ_BYTE()];                                      \
+    } while (false)
+
+    static void *dispatchTable[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_INHERIT] = &&label_OP_INHERIT,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_GET_LOCAL2] = &&label_OP_GET_LOCAL2,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_ADD_LOCAL_CONST] = &&label_OP_ADD_LOCAL_CONST,
+        [OP_LESS_LOCAL_CONST_JUMP] = &&label_OP_LESS_LOCAL_CONST_JUMP,
+        [OP_ARITH_CONST] = &&label_OP_ARITH_CONST,
+        [OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+        [OP_GET_FIELD] = &&label_OP_GET_FIELD,
+        [OP_SET_FIELD] = &&label_OP_SET_FIELD,
+        [OP_REG_STACK] = &&label_OP_REG_STACK,
+        [OP_REG_MOVE] = &&label_OP_REG_MOVE,
+        [OP_REG_LOADK] = &&label_OP_REG_LOADK,
+        [OP_REG_NIL] = &&label_OP_REG_NIL,
+        [OP_REG_TRUE] = &&label_OP_REG_TRUE,
+        [OP_REG_FALSE] = &&label_OP_REG_FALSE,
+        [OP_REG_GET_GLOBAL] = &&label_OP_REG_GET_GLOBAL,
+        [OP_REG_DEFINE_GLOBAL] = &&label_OP_REG_DEFINE_GLOBAL,
+        [OP_REG_SET_GLOBAL] = &&label_OP_REG_SET_GLOBAL,
+        [OP_REG_GET_UPVALUE] = &&label_OP_REG_GET_UPVALUE,
+        [OP_REG_SET_UPVALUE] = &&label_OP_REG_SET_UPVALUE,
+        [OP_REG_EQUAL] = &&label_OP_REG_EQUAL,
+        [OP_REG_GREATER] = &&label_OP_REG_GREATER,
+        [OP_REG_LESS] = &&label_OP_REG_LESS,
+        [OP_REG_ADD] = &&label_OP_REG_ADD,
+        [OP_REG_SUBTRACT] = &&label_OP_REG_SUBTRACT,
+        [OP_REG_MULTIPLY] = &&label_OP_REG_MULTIPLY,
+        [OP_REG_DIVIDE] = &&label_OP_REG_DIVIDE,
+        [OP_REG_GREATER_K] = &&label_OP_REG_GREATER_K,
+        [OP_REG_LESS_K] = &&label_OP_REG_LESS_K,
+        [OP_REG_ADD_K] = &&label_OP_REG_ADD_K,
+        [OP_REG_SUBTRACT_K] = &&label_OP_REG_SUBTRACT_K,
+        [OP_REG_MULTIPLY_K] = &&label_OP_REG_MULTIPLY_K,
+        [OP_REG_DIVIDE_K] = &&label_OP_REG_DIVIDE_K,
+        [OP_REG_NOT] = &&label_OP_REG_NOT,
+        [OP_REG_NEGATE] = &&label_OP_REG_NEGATE,
+        [OP_REG_PRINT] = &&label_OP_REG_PRINT,
+        [OP_REG_JUMP] = &&label_OP_REG_JUMP,
+        [OP_REG_JUMP_IF_FALSE] = &&label_OP_REG_JUMP_IF_FALSE,
+        [OP_REG_JUMP_IF_NOT_LESS] = &&label_OP_REG_JUMP_IF_NOT_LESS,
+        [OP_REG_JUMP_IF_NOT_LESS_K] = &&label_OP_REG_JUMP_IF_NOT_LESS_K,
+        [OP_REG_JUMP_IF_NOT_GREATER] = &&label_OP_REG_JUMP_IF_NOT_GREATER,
+        [OP_REG_JUMP_IF_NOT_GREATER_K] = &&label_OP_REG_JUMP_IF_NOT_GREATER_K,
+        [OP_REG_LOOP] = &&label_OP_REG_LOOP,
+        [OP_REG_CALL] = &&label_OP_REG_CALL,
+        [OP_REG_RETURN] = &&label_OP_REG_RETURN,
+    };
+#else
+#define DISPATCH() continue
+#endif
+
+    // 直接线程分派时只有第一条指令经过switch
+    for (;;) {
+        TRACE_EXECUTION();
+        switch (READ_BYTE()) {
+        CASE(OP_CONSTANT): {
             Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_LOCAL: {
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            (void)POP();
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            DISPATCH();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_SET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
+            slots[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value)) {
-                runtimeError("Undefined variable '%s'.", name->chars);
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.",
+                             AS_CSTRING(vm.globalNames.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
-            break;
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
-            break;
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
         }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.",
+                             AS_CSTRING(vm.globalNames.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_GET_UPVALUE: {
+        CASE(OP_GET_UPVALUE): {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
         }
-        case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj *)upvalue, PEEK(0));
+            DISPATCH();
         }
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjInstance *instance = AS_INSTANCE(peek(0));
+        CASE(OP_GET_PROPERTY): {
             ObjString *name = READ_STRING();
-
-            Value value;
-            if (tableGet(&instance->fields, name, &value)) {
-                pop(); // Instance.
-                push(value);
-                break;
-            }
-
-            if (!bindMethod(instance->klass, name)) {
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!getProperty(name, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            LOAD_STACK();
+            // 缓存首项一旦是字段项就不会再变
+            if (cache->entries[0].shape != NULL &&
+                cache->entries[0].index >= 0) {
+                ip[-4] = OP_GET_FIELD;
+            }
+            DISPATCH();
         }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtimeError("Only instances have fields.");
+        CASE(OP_SET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!setProperty(name, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(), peek(0));
-            Value value = pop();
-            pop();
-            push(value);
-            break;
+            LOAD_STACK();
+            if (cache->entries[0].shape != NULL &&
+                cache->entries[0].transition == NULL) {
+                ip[-4] = OP_SET_FIELD;
+            }
+            DISPATCH();
         }
-        case OP_GET_SUPER: {
+        CASE(OP_GET_SUPER): {
             ObjString *name = READ_STRING();
-            ObjClass *superclass = AS_CLASS(pop());
+            ObjClass *superclass = AS_CLASS(POP());
 
+            STORE_FRAME();
             if (!bindMethod(superclass, name)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            LOAD_STACK();
+            DISPATCH();
         }
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
         }
-        case OP_GREATER:
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            DISPATCH();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+            DISPATCH();
+        CASE(OP_ADD): {
+            PROFILE_TYPES(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)));
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+                ip[-1] = OP_ADD_NUMBER;
+            } else if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+                STORE_FRAME();
                 concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                LOAD_STACK();
             } else {
+                STORE_FRAME();
                 runtimeError("Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            DISPATCH();
         }
-        case OP_SUBTRACT:
+        CASE(OP_SUBTRACT):
             BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            DISPATCH();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
+            DISPATCH();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
+            DISPATCH();
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            PROFILE_TYPES(IS_NUMBER(PEEK(0)));
+            if (!IS_NUMBER(PEEK(0))) {
+                STORE_FRAME();
                 runtimeError("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_PRINT: {
-            printValue(pop());
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            printValue(POP());
             printf("\n");
-            break;
+            DISPATCH();
         }
-        case OP_JUMP: {
+        CASE(OP_JUMP): {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            ip += offset;
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE: {
+        CASE(OP_JUMP_IF_FALSE): {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-                frame->ip += offset;
-            break;
+            if (isFalsey(PEEK(0)))
+                ip += offset;
+            DISPATCH();
         }
-        case OP_LOOP: {
+        CASE(OP_LOOP): {
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            ip -= offset;
+#ifdef OPEN_JIT
+            // 循环变热后 从循环头进入JIT代码执行函数剩下的部分
+            ObjFunction *function = frame->closure->function;
+            function->loopCount++;
+            if (vm.jitThreshold >= 0 &&
+                function->loopCount >= vm.jitThreshold) {
+                STORE_FRAME();
+                if (function->osrFunction == NULL) {
+                    jitCompileOsr(&vm, function);
+                }
+                if (function->osrFunction != NULL) {
+                    if (function->osrFunction(&vm, frame->closure) ==
+                        INTERPRET_RUNTIME_ERROR) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // JIT代码已经弹出了该栈帧 退优化时栈帧还在 ip已回写
+                    if (vm.frameCount == baseFrameCount) {
+                        return INTERPRET_OK;
+                    }
+                    LOAD_FRAME();
+                }
+            }
+#endif
+            DISPATCH();
         }
-        case OP_CALL: {
+        CASE(OP_CALL): {
             int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount)) {
+            STORE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             // 调用后将栈帧设置成新函数的
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_INVOKE: {
+        CASE(OP_INVOKE): {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            if (!invoke(method, argCount)) {
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_SUPER_INVOKE: {
+        CASE(OP_SUPER_INVOKE): {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            ObjClass *superclass = AS_CLASS(pop());
+            ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
             if (!invokeFromClass(superclass, method, argCount)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_CLOSURE: {
+        CASE(OP_CLOSURE): {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
             ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
+            PUSH(OBJ_VAL(closure));
+            // 捕获提升值会分配对象 闭包要先在vm栈上
+            STORE_FRAME();
             for (int i = 0; i < closure->upvalueCount; i++) {
                 uint8_t isLocal = READ_BYTE();
                 uint8_t index = READ_BYTE();
                 if (isLocal) {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    closure->upvalues[i] = captureUpvalue(slots + index);
                 } else {
                     closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                // 捕获时的分配可能让闭包晋升
+                writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
             }
-            break;
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
-        case OP_RETURN: {
-            Value result = pop();
-            closeUpvalues(frame->slots);
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            (void)POP();
+            DISPATCH();
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(slots);
             vm.frameCount--;
             if (vm.frameCount == 0) {
-                pop();
+                vm.stackTop = stackTop - 1;
                 return INTERPRET_OK;
             }
 
-            vm.stackTop = frame->slots;
+            vm.stackTop = slots;
             push(result);
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        }
-        case OP_CLASS:
-            push(OBJ_VAL(newClass(READ_STRING())));
-            break;
-        case OP_INHERIT: {
-            Value superclass = peek(1);
+            if (vm.frameCount == baseFrameCount) {
+                return INTERPRET_OK;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            STORE_FRAME();
             if (!IS_CLASS(superclass)) {
                 runtimeError("Superclass must be a class.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjClass *subclass = AS_CLASS(peek(0));
+            ObjClass *subclass = AS_CLASS(PEEK(0));
             tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-            pop(); // Subclass.
-            break;
+            rememberObject((Obj *)subclass);
+            (void)POP(); // Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(name);
+            LOAD_STACK();
+            DISPATCH();
+        }
+        // 超级指令 ip指向首个指令的操作数 各字节的位置见chunk.h
+        CASE(OP_GET_LOCAL2):
+            PUSH(slots[ip[0]]);
+            PUSH(slots[ip[2]]);
+            ip += 3;
+            DISPATCH();
+        CASE(OP_SET_LOCAL_POP):
+            slots[ip[0]] = POP();
+            ip += 2;
+            DISPATCH();
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = (uint16_t)((ip[0] << 8) | ip[1]);
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                FALLBACK(OP_SET_GLOBAL);
+            }
+            vm.globalValues.values[slot] = POP();
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONST): {
+            Value value = slots[ip[0]];
+            if (!IS_NUMBER(value)) {
+                FALLBACK(OP_GET_LOCAL);
+            }
+            Value constant = frame->closure->function->chunk.constants
+                                 .values[ip[2]];
+            PROFILE_NUMBER_AT(ip + 3);
+            slots[ip[5]] = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant));
+            ip += 7;
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONST_JUMP): {
+            Value value = slots[ip[0]];
+            if (!IS_NUMBER(value)) {
+                FALLBACK(OP_GET_LOCAL);
+            }
+            Value constant = frame->closure->function->chunk.constants
+                                 .values[ip[2]];
+            PROFILE_NUMBER_AT(ip + 3);
+            if (AS_NUMBER(value) < AS_NUMBER(constant)) {
+                ip += 8;
+            } else {
+                // 跳过目标处的OP_POP 条件值从未压栈
+                ip += 8 + ((ip[5] << 8) | ip[6]);
+            }
+            DISPATCH();
         }
-        case OP_METHOD:
-            defineMethod(READ_STRING());
-            break;
+        CASE(OP_ARITH_CONST): {
+            if (!IS_NUMBER(PEEK(0))) {
+                FALLBACK(OP_CONSTANT);
+            }
+            double a = AS_NUMBER(PEEK(0));
+            double b = AS_NUMBER(
+                frame->closure->function->chunk.constants.values[ip[0]]);
+            // 序列中的运算指令单独执行过时可能已被快速化 按原指令区分
+            switch (baseOpcode(ip[1])) {
+            case OP_ADD: a += b; break;
+            case OP_SUBTRACT: a -= b; break;
+            case OP_MULTIPLY: a *= b; break;
+            case OP_DIVIDE: a /= b; break;
+            default:
+                // optimizeChunk只融合以上四种运算
+                STORE_FRAME();
+                runtimeError("Unexpected arithmetic instruction.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            PROFILE_NUMBER_AT(ip + 1);
+            PEEK(0) = NUMBER_VAL(a);
+            ip += 2;
+            DISPATCH();
+        }
+        // 快速化指令 推测失败时改回原指令
+        CASE(OP_ADD_NUMBER):
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                ip[-1] = OP_ADD;
+                FALLBACK(OP_ADD);
+            } else {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            }
+            DISPATCH();
+        CASE(OP_GET_FIELD): {
+            InlineCacheEntry *entry =
+                &frame->closure->function->inlineCaches[(ip[1] << 8) | ip[2]]
+                     .entries[0];
+            Value receiver = PEEK(0);
+            if (!IS_INSTANCE(receiver) ||
+                AS_INSTANCE(receiver)->shape != entry->shape) {
+                FALLBACK(OP_GET_PROPERTY);
+            }
+            PEEK(0) = AS_INSTANCE(receiver)->fields[entry->index];
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_SET_FIELD): {
+            InlineCacheEntry *entry =
+                &frame->closure->function->inlineCaches[(ip[1] << 8) | ip[2]]
+                     .entries[0];
+            Value receiver = PEEK(1);
+            if (!IS_INSTANCE(receiver) ||
+                AS_INSTANCE(receiver)->shape != entry->shape) {
+                FALLBACK(OP_SET_PROPERTY);
+            }
+            Value value = POP();
+            AS_INSTANCE(receiver)->fields[entry->index] = value;
+            writeBarrier(AS_OBJ(receiver), value);
+            PEEK(0) = value;
+            ip += 3;
+            DISPATCH();
+        }
+        // 寄存器指令 ip指向第一个操作数 各操作数见chunk.h
+        // 寄存器指令不维护stackTop 会触发GC或调用的指令先按操作数设好栈顶
+        CASE(OP_REG_STACK):
+            stackTop = slots + READ_BYTE();
+            DISPATCH();
+        CASE(OP_REG_MOVE):
+            REGISTER(0) = REGISTER(1);
+            ip += 2;
+            DISPATCH();
+        CASE(OP_REG_LOADK):
+            REGISTER(0) = REGISTER_CONSTANT(1);
+            ip += 2;
+            DISPATCH();
+        CASE(OP_REG_NIL):
+            REGISTER(0) = NIL_VAL;
+            ip += 1;
+            DISPATCH();
+        CASE(OP_REG_TRUE):
+            REGISTER(0) = BOOL_VAL(true);
+            ip += 1;
+            DISPATCH();
+        CASE(OP_REG_FALSE):
+            REGISTER(0) = BOOL_VAL(false);
+            ip += 1;
+            DISPATCH();
+        CASE(OP_REG_GET_GLOBAL): {
+            uint16_t slot = REGISTER_SHORT(1);
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.",
+                             AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            REGISTER(0) = value;
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_REG_DEFINE_GLOBAL):
+            vm.globalValues.values[REGISTER_SHORT(1)] = REGISTER(0);
+            ip += 3;
+            DISPATCH();
+        CASE(OP_REG_SET_GLOBAL): {
+            uint16_t slot = REGISTER_SHORT(1);
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.",
+                             AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = REGISTER(0);
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_REG_GET_UPVALUE):
+            REGISTER(0) = *frame->closure->upvalues[ip[1]]->location;
+            ip += 2;
+            DISPATCH();
+        CASE(OP_REG_SET_UPVALUE): {
+            ObjUpvalue *upvalue = frame->closure->upvalues[ip[1]];
+            *upvalue->location = REGISTER(0);
+            writeBarrier((Obj *)upvalue, REGISTER(0));
+            ip += 2;
+            DISPATCH();
+        }
+        CASE(OP_REG_EQUAL):
+            REGISTER(0) = BOOL_VAL(valuesEqual(REGISTER(1), REGISTER(2)));
+            ip += 3;
+            DISPATCH();
+        CASE(OP_REG_GREATER):
+            REGISTER_BINARY_OP(BOOL_VAL, >, REGISTER(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_LESS):
+            REGISTER_BINARY_OP(BOOL_VAL, <, REGISTER(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_ADD): {
+            Value a = REGISTER(1);
+            Value b = REGISTER(2);
+            PROFILE_REGISTER(IS_NUMBER(a) && IS_NUMBER(b));
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                REGISTER(0) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+                // 在结果所在的栈深度按栈指令拼接 其下的槽都已写回
+                stackTop = slots + ip[3];
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                concatenate();
+                REGISTER(0) = slots[ip[3]];
+            } else {
+                STORE_FRAME();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ip += 4;
+            DISPATCH();
+        }
+        CASE(OP_REG_SUBTRACT):
+            REGISTER_BINARY_OP(NUMBER_VAL, -, REGISTER(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_MULTIPLY):
+            REGISTER_BINARY_OP(NUMBER_VAL, *, REGISTER(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_DIVIDE):
+            REGISTER_BINARY_OP(NUMBER_VAL, /, REGISTER(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_GREATER_K):
+            REGISTER_BINARY_OP(BOOL_VAL, >, REGISTER_CONSTANT(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_LESS_K):
+            REGISTER_BINARY_OP(BOOL_VAL, <, REGISTER_CONSTANT(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_ADD_K):
+            REGISTER_BINARY_OP(NUMBER_VAL, +, REGISTER_CONSTANT(2),
+                               "Operands must be two numbers or two strings.");
+            DISPATCH();
+        CASE(OP_REG_SUBTRACT_K):
+            REGISTER_BINARY_OP(NUMBER_VAL, -, REGISTER_CONSTANT(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_MULTIPLY_K):
+            REGISTER_BINARY_OP(NUMBER_VAL, *, REGISTER_CONSTANT(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_DIVIDE_K):
+            REGISTER_BINARY_OP(NUMBER_VAL, /, REGISTER_CONSTANT(2),
+                               "Operands must be numbers.");
+            DISPATCH();
+        CASE(OP_REG_NOT):
+            REGISTER(0) = BOOL_VAL(isFalsey(REGISTER(1)));
+            ip += 2;
+            DISPATCH();
+        CASE(OP_REG_NEGATE): {
+            Value value = REGISTER(1);
+            PROFILE_REGISTER(IS_NUMBER(value));
+            if (!IS_NUMBER(value)) {
+                STORE_FRAME();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            REGISTER(0) = NUMBER_VAL(-AS_NUMBER(value));
+            ip += 2;
+            DISPATCH();
+        }
+        CASE(OP_REG_PRINT):
+            printValue(REGISTER(0));
+            printf("\n");
+            ip += 1;
+            DISPATCH();
+        CASE(OP_REG_JUMP):
+            ip += 2 + REGISTER_SHORT(0);
+            DISPATCH();
+        CASE(OP_REG_JUMP_IF_FALSE):
+            if (isFalsey(REGISTER(0))) {
+                ip += 3 + REGISTER_SHORT(1);
+            } else {
+                ip += 3;
+            }
+            DISPATCH();
+        CASE(OP_REG_JUMP_IF_NOT_LESS):
+            REGISTER_COMPARE_JUMP(<, REGISTER(1));
+            DISPATCH();
+        CASE(OP_REG_JUMP_IF_NOT_LESS_K):
+            REGISTER_COMPARE_JUMP(<, REGISTER_CONSTANT(1));
+            DISPATCH();
+        CASE(OP_REG_JUMP_IF_NOT_GREATER):
+            REGISTER_COMPARE_JUMP(>, REGISTER(1));
+            DISPATCH();
+        CASE(OP_REG_JUMP_IF_NOT_GREATER_K):
+            REGISTER_COMPARE_JUMP(>, REGISTER_CONSTANT(1));
+            DISPATCH();
+        CASE(OP_REG_LOOP): {
+            uint8_t *loop = ip + 5 - REGISTER_SHORT(0);
+#ifdef OPEN_JIT
+            ObjFunction *function = frame->closure->function;
+            function->loopCount++;
+            if (vm.jitThreshold >= 0 &&
+                function->loopCount >= vm.jitThreshold) {
+                // 循环头处寄存器都已写回 与栈字节码的状态一致
+                // 按栈字节码的循环头进入OSR代码
+                uint8_t *header = function->chunk.code + REGISTER_SHORT(2);
+                stackTop = slots + ip[4];
+                ip = header;
+                STORE_FRAME();
+                if (function->osrFunction == NULL) {
+                    jitCompileOsr(&vm, function);
+                }
+                if (function->osrFunction != NULL) {
+                    if (function->osrFunction(&vm, frame->closure) ==
+                        INTERPRET_RUNTIME_ERROR) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if (vm.frameCount == baseFrameCount) {
+                        return INTERPRET_OK;
+                    }
+                    LOAD_FRAME();
+                    // 编译还没完成或进入时就退优化了 回到寄存器字节码
+                    // 否则从退优化处接着执行栈字节码
+                    if (ip == header) {
+                        ip = loop;
+                    }
+                    DISPATCH();
+                }
+            }
+#endif
+            ip = loop;
+            DISPATCH();
+        }
+        CASE(OP_REG_CALL): {
+            Value *callee = slots + ip[0];
+            int argCount = ip[1];
+            ip += 2;
+            stackTop = callee + argCount + 1;
+            STORE_FRAME();
+            if (!callValue(*callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_REG_RETURN):
+            // 返回值放到栈顶 按栈指令返回
+            stackTop = slots + ip[0] + 1;
+            FALLBACK(OP_RETURN);
         }
     }
 
@@ -592,7 +1418,44 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_STACK
+#undef LOAD_FRAME
 #undef BINARY_OP
+#undef PROFILE_TYPES
+#undef PROFILE_NUMBER_AT
+#undef PROFILE_REGISTER
+#undef REGISTER
+#undef REGISTER_CONSTANT
+#undef REGISTER_SHORT
+#undef REGISTER_BINARY_OP
+#undef REGISTER_COMPARE_JUMP
+#undef TRACE_EXECUTION
+#undef CASE
+#undef FALLBACK
+#undef DISPATCH
+}
+
+// 执行编译好的脚本函数
+static InterpretResult runScript(ObjFunction *function) {
+    push(OBJ_VAL(function));
+
+    ObjClosure *closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+
+    if (!call(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    // 脚本已经由JIT代码执行完
+    if (vm.frameCount == 0) {
+        return INTERPRET_OK;
+    }
+    return run();
 }
 
 InterpretResult interpret(const char *source) {
@@ -600,17 +1463,21 @@ InterpretResult interpret(const char *source) {
     ObjFunction *function = compile(source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
+}
 
-    push(OBJ_VAL(function));
-
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
+InterpretResult interpretSnapshot(const uint8_t *data, size_t size) {
+    ObjFunction *function = readSnapshot(data, size);
+    if (function == NULL)
+        return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
+}
 
 #ifdef OPEN_JIT
-    return call(closure, 0) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
-#else
-    call(closure, 0);
-    return run();
-#endif
-}
\ No newline at end of file
+bool finishCall(int frameCount) {
+    if (vm.frameCount == frameCount) {
+        return true;
+    }
+    return run() == INTERPRET_OK;
+}
+#endif
\ No newline at end of file
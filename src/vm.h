@@ -12,13 +12,32 @@
 #include "value.h"
 #ifdef OPEN_JIT
 #include "mir.h"
+#ifdef JIT_C_BACKEND
 #include "c2mir.h"
 #endif
+#endif
 
 // 栈数组最大值
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+// 增量回收所处的阶段
+typedef enum {
+    GC_IDLE,  // 没有进行中的回收
+    GC_MARK,  // 分片标记 灰色对象在grayStack里
+    GC_SWEEP, // 分片清扫 待清扫的对象在sweepObjects和sweepYoung里
+} GCPhase;
+
+// 垃圾回收统计 --gc-stats时退出前打印
+typedef struct {
+    int minorCount;       // 新生代回收次数
+    int fullCount;        // 完整回收次数 增量回收按周期计
+    int pauseCount;       // 停顿次数 增量回收每片算一次
+    uint64_t liveObjects; // 每次完整回收后存活的对象数之和 和标记线程数无关
+    uint64_t totalPause;  // 停顿总时长 纳秒
+    uint64_t maxPause;    // 最长停顿 纳秒
+} GCStats;
+
 // 调用帧
 typedef struct {
     ObjClosure* closure;        // 调用的函数闭包
@@ -33,29 +52,59 @@ typedef struct {
 
     Value stack[STACK_MAX];         // 虚拟机栈
     Value* stackTop;                // 栈顶指针 总是指向栈顶
-    Table globals;                  // 全局变量表
+    ValueArray globalValues;        // 全局变量值 按编译期分配的下标存放 未定义为UNDEFINED_VAL
+    ValueArray globalNames;         // 下标 -> 全局变量名 报错和反汇编时使用
+    Table globalSlots;              // 全局变量名 -> 下标
     Table strings;                  // 全局字符串表
     ObjString* initString;          // 构造器名称
+    ObjShape* rootShape;            // 没有字段的实例的形状
     ObjUpvalue* openUpvalues;       // 全局提升值
+    bool registerTarget;            // 编译时另外生成寄存器字节码 由解释器执行
 
     size_t bytesAllocated;          // 已经分配的内存
     size_t nextGC;                  // 出发下一次gc的阈值
 
-    Obj* objects;                   // 对象根链表
+    Obj* objects;                   // 老对象链表 只在完整回收时清扫
+    Obj* youngObjects;              // 新生代链表 上次回收后分配的对象
+    size_t nextYoungGC;             // 触发下一次新生代回收的阈值
+    int rememberedCount;            // 记忆集中的对象数
+    int rememberedCapacity;         // 记忆集容量
+    Obj** rememberedSet;            // 引用了新对象的老对象 增量标记时为写入过白色对象的黑色对象
+
+    bool gcIncremental;             // 增量回收 标记和清扫分片穿插在分配之间 不分代
+    GCPhase gcPhase;                // 增量回收的阶段
+    uint64_t gcPause;               // 增量回收每片的时间预算 纳秒 为0时每片只做一个对象
+    size_t nextGCStep;              // 触发下一片增量回收的阈值
+    Obj* sweepObjects;              // 待清扫的老对象
+    Obj* sweepYoung;                // 待清扫的新对象
+    int gcThreads;                  // 完整回收时的标记线程数 1为单线程标记
+    bool gcReport;                  // 退出前打印回收统计
+    GCStats gcStats;                // 回收统计
     int grayCount;                  // 灰色对象数量
     int grayCapacity;               // 灰色对象容量
     Obj** grayStack;                // 灰色对象栈
 
 #ifdef OPEN_JIT
-    MIR_context_t mirContext;
+    int jitThreshold;               // 函数变热的阈值
+    MIR_context_t mirContext;       // MIR上下文
+    int jitModuleCount;             // 已生成的JIT模块数 用于命名
+    bool jitReport;                 // --jit-stats 退出前打印模块数
+    bool jitBackground;             // 是否在后台线程编译
+    struct JitQueue* jitQueue;      // 后台编译队列 首次编译时创建
+    const char* jitCacheDir;        // MIR模块缓存目录 为NULL时不缓存
+#ifdef JIT_C_BACKEND
     struct c2mir_options mirOptions;
 #endif
+#endif
 } VM;
 
 typedef enum {
     INTERPRET_OK,               // 解释执行成功
     INTERPRET_COMPILE_ERROR,    // 编译期异常
-    INTERPRET_RUNTIME_ERROR     // 运行时异常
+    INTERPRET_RUNTIME_ERROR,    // 运行时异常
+#ifdef OPEN_JIT
+    INTERPRET_DEOPT             // JIT代码推测失败 栈帧留给解释器继续执行
+#endif
 } InterpretResult;
 
 extern VM vm;
@@ -69,6 +118,9 @@ void freeVM();
 // 解释字节码块
 InterpretResult interpret(const char* source);
 
+// 执行快照中编译好的脚本 快照不对时为INTERPRET_COMPILE_ERROR
+InterpretResult interpretSnapshot(const uint8_t* data, size_t size);
+
 // 压入虚拟机栈
 void push(Value value);
 
@@ -83,10 +135,20 @@ bool callValue(Value callee, int argCount);
 
 bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount);
 
-bool invoke(ObjString *name, int argCount);
+bool invoke(ObjString *name, int argCount, InlineCache *cache);
+
+bool getProperty(ObjString *name, InlineCache *cache);
+
+bool setProperty(ObjString *name, InlineCache *cache);
 
 void closeUpvalues(Value *last);
 
+// 全局变量名对应的下标 第一次出现时分配 值为UNDEFINED_VAL
+int globalSlot(ObjString *name);
+
+// 栈帧的ip所在的字节码块 执行寄存器字节码的函数退优化后会回到栈字节码
+Chunk *frameChunk(CallFrame *frame);
+
 bool isFalsey(Value value);
 
 void concatenate();
@@ -97,4 +159,9 @@ void defineMethod(ObjString *name);
 
 bool bindMethod(ObjClass *klass, ObjString *name);
 
+#ifdef OPEN_JIT
+// JIT代码调用函数后 若被调用者压入了解释器帧 则解释执行到它返回
+bool finishCall(int frameCount);
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+#!/bin/sh
+# 运行test目录下的脚本 与脚本中的 // expect: 注释逐行比较
+# 用法: sh test/run.sh [lox可执行文件]  默认为src/lox
+# 脚本第一行可以写 // options: ... 指定启动选项
+# 有 // expect stderr: 注释时标准错误也逐行比较
+# // modes: A | B 用基础选项加上每组选项各再运行一次 输出和标准错误都要和基础运行相同
+# 选项里的loxc表示先用--compile编译成字节码快照 再运行快照
+# DEBUG_PRINT_CODE打印的反汇编和--gc-stats打印的停顿时间不参与比较
+
+lox=${1:-src/lox}
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/lox-test.$$
+failed=0
+total=0
+
+# 运行一次 输出写到$1.out 标准错误写到$1.err
+run() {
+    out=$1
+    shift
+    $lox "$@" 2> "$out.raw" | grep -Ev '^(== |[0-9]{4} |      \|)' > "$out.out"
+    grep -v '^\[gc\] pause ' "$out.raw" > "$out.err"
+}
+
+for script in "$dir"/*.lox; do
+    total=$((total + 1))
+    ok=true
+    options=$(sed -n '1s|^// options: ||p' "$script")
+    grep -o '// expect: .*' "$script" | sed 's|^// expect: ||' > "$tmp.expected"
+    grep -o '// expect stderr: .*' "$script" |
+        sed 's|^// expect stderr: ||' > "$tmp.experr"
+    run "$tmp.base" $options "$script"
+    if ! cmp -s "$tmp.expected" "$tmp.base.out" ||
+        { [ -s "$tmp.experr" ] && ! cmp -s "$tmp.experr" "$tmp.base.err"; }; then
+        echo "FAIL $script"
+        diff "$tmp.expected" "$tmp.base.out"
+        cat "$tmp.base.err"
+        ok=false
+    fi
+
+    modes=$(sed -n 's|^// modes: ||p' "$script")
+    set -f
+    IFS='|'
+    set -- $modes
+    unset IFS
+    set +f
+    for mode; do
+        mode=$(echo $mode)
+        target=$script
+        case " $mode " in
+        *" loxc "*)
+            mode=$(echo " $mode " | sed 's| loxc | |; s|^ *||; s| *$||')
+            $lox --compile "$tmp.loxc" "$script" > /dev/null 2>&1
+            target=$tmp.loxc
+            ;;
+        esac
+        run "$tmp.mode" $options $mode "$target"
+        if ! cmp -s "$tmp.base.out" "$tmp.mode.out" ||
+            ! cmp -s "$tmp.base.err" "$tmp.mode.err"; then
+            echo "FAIL $script ($mode)"
+            diff "$tmp.base.out" "$tmp.mode.out"
+            diff "$tmp.base.err" "$tmp.mode.err"
+            ok=false
+        fi
+    done
+    $ok || failed=$((failed + 1))
+done
+
+rm -f "$tmp".*
+echo "$((total - failed))/$total passed"
+[ $failed -eq 0 ]